@@ -0,0 +1,41 @@
+/*
+** Counts calls to malloc, calloc and realloc, for the allocation
+** figures in lisp_bench.sh. Preload it with LD_PRELOAD and name a
+** file in ALLOC_COUNT_FILE; the count is written there when the
+** process exits. It calls into glibc directly, so it only builds
+** and works on glibc systems.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t m);
+extern void *__libc_realloc(void *p, size_t n);
+
+static unsigned long alloc_count = 0;
+
+void *malloc(size_t n) {
+  alloc_count++;
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t m) {
+  alloc_count++;
+  return __libc_calloc(n, m);
+}
+
+void *realloc(void *p, size_t n) {
+  alloc_count++;
+  return __libc_realloc(p, n);
+}
+
+__attribute__((destructor))
+static void alloc_count_report(void) {
+  unsigned long count = alloc_count;
+  const char *path = getenv("ALLOC_COUNT_FILE");
+  FILE *f;
+  if (path == NULL || (f = fopen(path, "w")) == NULL) { return; }
+  fprintf(f, "%lu\n", count);
+  fclose(f);
+}
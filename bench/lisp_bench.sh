@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+#
+# Timings for the interpreter workloads quoted in the commit log.
+#
+# Usage: lisp_bench.sh [path to interpreter]
+#
+# Every workload runs as a script (-f) with its output thrown away, so
+# the times are wall clock for the whole process: startup, reading and
+# evaluation. The empty script row is that startup cost on its own. The
+# script mode rows also pipe the same input through - and into the REPL;
+# the REPL rows time whichever readline the binary was linked against.
+
+set -e
+
+BIN=${1:-./sammallus}
+ALLOC=${ALLOC:-$(cd "$(dirname "$0")" && pwd)/alloc_count.so}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+TIMEFORMAT=%3R
+
+# numbers N PREFIX SUFFIX: one line holding PREFIX 1 2 ... N SUFFIX
+numbers() {
+    awk -v n="$1" -v pre="$2" -v post="$3" \
+        'BEGIN { printf "%s", pre; for(i = 1; i <= n; i++) printf " %d", i; print post }'
+}
+
+# lines N: N short expressions, cycling through a few shapes
+lines() {
+    awk -v n="$1" 'BEGIN {
+        for(i = 0; i < n; i++) {
+            if(i % 4 == 0) print "(+ 1 2 (* 3 4) (- 10 5))";
+            if(i % 4 == 1) print "(head {1 2 3 4 5 6 7 8})";
+            if(i % 4 == 2) print "(evaluate {join {1 2} {3 4}})";
+            if(i % 4 == 3) print "(list 1 2 3 (tail {4 5 6}))";
+        }
+    }'
+}
+
+# run LABEL FILE OPTIONS...
+run() {
+    local label=$1 file=$2
+    shift 2
+    printf '  %-44s ' "$label"
+    { time "$BIN" "$@" -f "$file" > /dev/null 2>&1; } 2>&1
+}
+
+# seconds FILE OPTIONS...: the wall clock time of one -f run, for tables
+seconds() {
+    local file=$1
+    shift
+    { time "$BIN" "$@" -f "$file" > /dev/null 2>&1; } 2>&1
+}
+
+# allocations FILE OPTIONS...: malloc, calloc and realloc calls in one -f run, or - when
+# alloc_count.so is not there
+allocations() {
+    local file=$1
+    shift
+    rm -f "$DIR/count"
+    if [ -f "$ALLOC" ]; then
+        ALLOC_COUNT_FILE="$DIR/count" LD_PRELOAD="$ALLOC" "$BIN" "$@" -f "$file" > /dev/null 2>&1 || true
+    fi
+    cat "$DIR/count" 2>/dev/null || echo -
+}
+
+# run_stdin LABEL FILE OPTIONS...: the same, with the script piped in through -
+run_stdin() {
+    local label=$1 file=$2
+    shift 2
+    printf '  %-44s ' "$label"
+    { time cat "$file" | "$BIN" "$@" - > /dev/null 2>&1; } 2>&1
+}
+
+# run_repl LABEL FILE OPTIONS...: the script piped into the interactive loop. The REPL does
+# not stop cleanly at the end of its input, so its exit status is ignored.
+run_repl() {
+    local label=$1 file=$2
+    shift 2
+    printf '  %-44s ' "$label"
+    { time cat "$file" | "$BIN" "$@" > /dev/null 2>&1 || true; } 2>&1
+}
+
+: > "$DIR/empty"
+numbers 100000 "{" "}" > "$DIR/list"
+for n in 1000 10000 100000 1000000; do
+    numbers $n "(+" ")" > "$DIR/+.$n"
+    numbers $n "(join {" "} {1 2 3})" > "$DIR/join.$n"
+    numbers $n "(head {" "})" > "$DIR/head.$n"
+    numbers $n "(tail {" "})" > "$DIR/tail.$n"
+    numbers $n "{" "}" > "$DIR/quote.$n"
+done
+awk 'BEGIN { for(i = 0; i < 20000; i++) print "(+ 1 (* 2 3) {head tail join} -4 5)" }' > "$DIR/short"
+lines 200000 > "$DIR/script"
+lines 20000 > "$DIR/script_small"
+
+echo "startup"
+run "empty script" "$DIR/empty"
+
+echo "tagged immediates: (+ 1 2 ... 100000), allocations beyond an empty script"
+base=$(allocations "$DIR/empty")
+printf '  %-44s %s %10s\n' "" "time" "allocations"
+for reader in --direct-reader ""; do
+    for engine in --tree-walker ""; do
+        options="$reader $engine"
+        count=$(allocations "$DIR/+.100000" $options)
+        if [ "$count" != - ] && [ "$base" != - ]; then
+            count=$((count - base))
+        fi
+        label="$([ -n "$engine" ] && echo tree walker || echo bytecode)"
+        label="$label, $([ -n "$reader" ] && echo direct || echo mpc) reader"
+        printf '  %-44s %s %10s\n' "$label" \
+            "$(seconds "$DIR/+.100000" $options)" "$count"
+    done
+done
+
+echo "list builtins by length, which should grow linearly"
+printf '  %-22s %9s %9s %9s %9s\n' "" 1e3 1e4 1e5 1e6
+for op in + join head tail; do
+    for engine in --tree-walker ""; do
+        printf '  %-22s' "$op ${engine:---bytecode}"
+        for n in 1000 10000 100000 1000000; do
+            printf ' %9s' "$(seconds "$DIR/$op.$n" --direct-reader $engine)"
+        done
+        echo
+    done
+done
+printf '  %-22s' "quoted list only"
+for n in 1000 10000 100000 1000000; do
+    printf ' %9s' "$(seconds "$DIR/quote.$n" --direct-reader)"
+done
+echo
+
+echo "readers: the mpc grammar against the direct reader"
+run "36-byte line x20000, mpc" "$DIR/short"
+run "36-byte line x20000, direct" "$DIR/short" --direct-reader
+run "$(wc -c < "$DIR/list" | tr -d ' ')-byte line, mpc" "$DIR/list"
+run "$(wc -c < "$DIR/list" | tr -d ' ')-byte line, direct" "$DIR/list" --direct-reader
+
+echo "script mode against the REPL"
+run "20k expressions, mpc reader, -f" "$DIR/script_small"
+run_stdin "20k expressions, mpc reader, piped to -" "$DIR/script_small"
+run_repl "20k expressions, mpc reader, REPL" "$DIR/script_small"
+run "20k expressions, direct reader, -f" "$DIR/script_small" --direct-reader
+run_repl "20k expressions, direct reader, REPL" "$DIR/script_small" --direct-reader
+run "200k expressions, direct reader, -f" "$DIR/script" --direct-reader
+run_stdin "200k expressions, direct reader, piped to -" "$DIR/script" --direct-reader
+run "200k expressions, direct reader, arena, -f" "$DIR/script" --direct-reader --arena
@@ -0,0 +1,414 @@
+/*
+** Timings for the parser workloads quoted in the commit log.
+**
+** Usage: mpc_bench [case ...] [-case ...]
+**
+** With no arguments every case runs. Naming cases runs only those,
+** and a name with a leading - skips that case. Times are CPU seconds
+** from clock(). Inputs come from a fixed generator, so runs on
+** different machines parse the same text.
+*/
+
+#include "../mpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long bench_seed = 1;
+
+static int bench_rand(int n) {
+  bench_seed = bench_seed * 1103515245ul + 12345ul;
+  return (int)((bench_seed >> 16) % (unsigned long)n);
+}
+
+static double bench_seconds(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench_result(mpc_result_t *r, int ok, mpc_dtor_t del) {
+  if (ok) { del(r->output); } else { mpc_err_delete(r->error); }
+}
+
+static void bench_ast_delete(mpc_val_t *x) { mpc_ast_delete(x); }
+
+/*
+** Sammallus
+**
+** The grammar from parsing.c, and random lines for it. When asked
+** for broken lines about one in eight gets a stray closing bracket,
+** so that errors get built too.
+*/
+
+static mpc_parser_t *sam_parsers[6];
+
+static mpc_parser_t *sam_new(void) {
+  mpc_err_t *e;
+  sam_parsers[0] = mpc_new("number");
+  sam_parsers[1] = mpc_new("symbol");
+  sam_parsers[2] = mpc_new("s_expression");
+  sam_parsers[3] = mpc_new("q_expression");
+  sam_parsers[4] = mpc_new("expression");
+  sam_parsers[5] = mpc_new("sammallus");
+  e = mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/; "
+    " symbol : '+' | '-' | '*' | '/' "
+    "        | \"list\" | \"head\" | \"tail\" | \"join\" | \"evaluate\"; "
+    " s_expression : '(' <expression>* ')'; "
+    " q_expression : '{' <expression>* '}'; "
+    " expression : <number> | <symbol> | <s_expression> | <q_expression>; "
+    " sammallus : /^/ <expression>* /$/; ",
+    sam_parsers[0], sam_parsers[1], sam_parsers[2],
+    sam_parsers[3], sam_parsers[4], sam_parsers[5], NULL);
+  if (e) { mpc_err_print(e); mpc_err_delete(e); exit(1); }
+  return sam_parsers[5];
+}
+
+static void sam_delete(void) {
+  mpc_cleanup(6, sam_parsers[0], sam_parsers[1], sam_parsers[2],
+    sam_parsers[3], sam_parsers[4], sam_parsers[5]);
+}
+
+static char *sam_expr(char *s, int depth) {
+  static const char *words[] = {
+    "+", "-", "*", "/", "list", "head", "tail", "join", "evaluate" };
+  int i, n, q;
+  switch (depth > 3 ? bench_rand(2) : bench_rand(4)) {
+    case 0: return s + sprintf(s, "%d", bench_rand(2000) - 1000);
+    case 1: return s + sprintf(s, "%s", words[bench_rand(9)]);
+    default:
+      n = bench_rand(5);
+      q = bench_rand(3) == 0;
+      *s++ = q ? '{' : '(';
+      for (i = 0; i < n; i++) {
+        if (i) { *s++ = ' '; }
+        s = sam_expr(s, depth + 1);
+      }
+      *s++ = q ? '}' : ')';
+      return s;
+  }
+}
+
+static char *sam_lines(int lines, int broken, size_t *length) {
+  char *text = malloc((size_t)lines * 4096), *s = text;
+  int i;
+  for (i = 0; i < lines; i++) {
+    s = sam_expr(s, 0);
+    if (broken && bench_rand(8) == 0) { *s++ = ')'; }
+    *s++ = '\n';
+  }
+  *s = '\0';
+  *length = (size_t)(s - text);
+  return text;
+}
+
+/*
+** Cases
+*/
+
+static void bench_any_sizes(const size_t *sizes, size_t num) {
+  mpc_parser_t *p = mpc_many(mpcf_strfold, mpc_any());
+  mpc_result_t r;
+  clock_t start;
+  double t;
+  size_t i, j;
+  char *text;
+  int k, reps, ok;
+  for (i = 0; i < num; i++) {
+    text = malloc(sizes[i] + 1);
+    for (j = 0; j < sizes[i]; j++) { text[j] = (char)('a' + j % 26); }
+    text[sizes[i]] = '\0';
+    reps = (int)((16 << 20) / sizes[i]);
+    reps = reps < 1 ? 1 : reps;
+    start = clock();
+    for (k = 0; k < reps; k++) {
+      ok = mpc_parse("<any>", text, p, &r);
+      bench_result(&r, ok, free);
+    }
+    t = bench_seconds(start);
+    printf("  many(any) %9lu bytes   %7.1f MB/s\n", (unsigned long)sizes[i],
+      (double)sizes[i] * reps / (1 << 20) / t);
+    free(text);
+  }
+  mpc_delete(p);
+}
+
+static void bench_any(void) {
+  static const size_t sizes[] = { 1 << 10, 64 << 10, 1 << 20, 10 << 20 };
+  bench_any_sizes(sizes, sizeof(sizes) / sizeof(sizes[0]));
+}
+
+/* Holds the input and the folded output, a few hundred MB at peak */
+static void bench_any_100mb(void) {
+  static const size_t sizes[] = { 100 << 20 };
+  bench_any_sizes(sizes, sizeof(sizes) / sizeof(sizes[0]));
+}
+
+static void bench_mmap(void) {
+  mpc_parser_t *p = sam_new();
+  mpc_result_t r;
+  clock_t start;
+  size_t length;
+  char *text = sam_lines(20000, 0, &length);
+  FILE *f = tmpfile();
+  int ok;
+
+  fwrite(text, 1, length, f);
+
+  rewind(f);
+  start = clock();
+  ok = mpc_parse_file("<file>", f, p, &r);
+  printf("  %lu bytes  mpc_parse_file   %.3fs%s\n",
+    (unsigned long)length, bench_seconds(start), ok ? "" : " (failed)");
+  bench_result(&r, ok, bench_ast_delete);
+
+  rewind(f);
+  start = clock();
+  ok = mpc_parse_mmap("<file>", f, p, &r);
+  printf("  %lu bytes  mpc_parse_mmap   %.3fs%s\n",
+    (unsigned long)length, bench_seconds(start), ok ? "" : " (failed)");
+  bench_result(&r, ok, bench_ast_delete);
+
+  fclose(f);
+  free(text);
+  sam_delete();
+}
+
+static void bench_lines(void) {
+  mpc_parser_t *p = sam_new();
+  mpc_parse_ctx_t *c = mpc_parse_ctx_new();
+  mpc_result_t r;
+  clock_t start;
+  size_t length;
+  char *text = sam_lines(8000, 1, &length), *line, *end;
+  int ok, good = 0, bad = 0;
+  start = clock();
+  for (line = text; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+    ok = mpc_parse_ctx_view(c, "<line>", line, (size_t)(end - line), p, &r);
+    if (ok) { good++; mpc_ast_delete(r.output); }
+    else { bad++; free(mpc_err_string(r.error)); mpc_err_delete(r.error); }
+  }
+  printf("  8000 lines (%d ok, %d failing)   %.3fs\n", good, bad, bench_seconds(start));
+  mpc_parse_ctx_delete(c);
+  free(text);
+  sam_delete();
+}
+
+static mpc_parser_t *bench_labels_or(char **words, int lo, int hi) {
+  if (hi - lo == 1) { return mpc_string(words[lo]); }
+  return mpc_or(2,
+    bench_labels_or(words, lo, (lo + hi) / 2),
+    bench_labels_or(words, (lo + hi) / 2, hi));
+}
+
+static void bench_labels(void) {
+  char *words[4000];
+  mpc_parser_t *p;
+  mpc_result_t r;
+  clock_t start;
+  int i, ok;
+  for (i = 0; i < 4000; i++) {
+    words[i] = malloc(16);
+    sprintf(words[i], "s%d", i);
+  }
+  p = bench_labels_or(words, 0, 4000);
+  start = clock();
+  for (i = 0; i < 20; i++) {
+    ok = mpc_parse("<labels>", "zzz", p, &r);
+    bench_result(&r, ok, free);
+  }
+  printf("  or of 4000 strings, 20 failing parses   %.3fs\n", bench_seconds(start));
+  mpc_delete(p);
+  for (i = 0; i < 4000; i++) { free(words[i]); }
+}
+
+static void bench_memo(void) {
+  static const int depths[] = { 8, 10, 12 };
+  mpc_parser_t *Expr, *Term, *Factor, *Top;
+  mpc_result_t r;
+  mpc_err_t *e;
+  clock_t start;
+  char *text;
+  int i, j, memo, ok;
+  size_t n;
+
+  for (memo = 0; memo < 2; memo++) {
+    Expr = mpc_new("expr");
+    Term = mpc_new("term");
+    Factor = mpc_new("factor");
+    Top = mpc_new("top");
+    e = mpca_lang(MPCA_LANG_DEFAULT,
+      " expr   : <term> '+' <expr> | <term> '-' <expr> | <term> ; "
+      " term   : <factor> '*' <term> | <factor> '/' <term> | <factor> ; "
+      " factor : '(' <expr> ')' | /[0-9]+/ ; "
+      " top    : /^/ <expr> /$/ ; ", Expr, Term, Factor, Top, NULL);
+    if (e) { mpc_err_print(e); mpc_err_delete(e); exit(1); }
+    if (memo) {
+      mpca_memoize(Expr);
+      mpca_memoize(Term);
+      mpca_memoize(Factor);
+    }
+
+    /* Unmemoized depth 12 takes several seconds, so it is left out */
+    for (i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])) - !memo; i++) {
+      text = malloc((size_t)depths[i] * 6 + 2);
+      n = 0;
+      for (j = 0; j < depths[i]; j++) { text[n++] = '('; text[n++] = '1'; text[n++] = '+'; }
+      text[n++] = '2';
+      for (j = 0; j < depths[i]; j++) { text[n++] = ')'; text[n++] = '*'; text[n++] = '3'; }
+      text[n] = '\0';
+      start = clock();
+      ok = mpc_parse("<expr>", text, Top, &r);
+      printf("  depth %2d %-10s %.3fs\n", depths[i],
+        memo ? "memoized" : "plain", bench_seconds(start));
+      bench_result(&r, ok, bench_ast_delete);
+      free(text);
+    }
+
+    mpc_cleanup(4, Expr, Term, Factor, Top);
+  }
+}
+
+static void bench_dispatch(void) {
+  static const int alternatives[] = { 4, 26, 104 };
+  mpc_parser_t *p, *x;
+  mpc_result_t r;
+  clock_t start;
+  char lead[104], *text;
+  size_t n;
+  int i, j, k, ok;
+
+  for (k = 0; k < 104; k++) {
+    lead[k] = (char)(k < 26 ? 'A' + k : k < 52 ? 'a' + k - 26 : 128 + k);
+  }
+
+  for (i = 0; i < (int)(sizeof(alternatives) / sizeof(alternatives[0])); i++) {
+
+    p = NULL;
+    for (k = 0; k < alternatives[i]; k++) {
+      x = mpc_and(3, mpcf_strfold,
+        mpc_char(lead[k]), mpc_many1(mpcf_strfold, mpc_digit()), mpc_char('y'),
+        free, free);
+      p = p ? mpc_or(2, p, x) : x;
+    }
+    p = mpc_and(2, mpcf_snd_free, mpc_many(mpcf_strfold, p), mpc_eoi(), free);
+    mpc_optimise(p);
+
+    text = malloc(100001);
+    n = 0;
+    while (n < 100000 - 8) {
+      text[n++] = lead[bench_rand(alternatives[i])];
+      for (j = 1 + bench_rand(4); j > 0; j--) { text[n++] = (char)('0' + bench_rand(10)); }
+      text[n++] = 'y';
+    }
+    text[n] = '\0';
+
+    start = clock();
+    for (k = 0; k < 20; k++) {
+      ok = mpc_parse("<dispatch>", text, p, &r);
+      bench_result(&r, ok, free);
+    }
+    printf("  or of %3d alternatives, 100 KB x20   %.3fs\n",
+      alternatives[i], bench_seconds(start));
+
+    free(text);
+    mpc_delete(p);
+  }
+}
+
+static void bench_keywords(void) {
+  static const char *words[] = {
+    "evaluate", "list", "last", "load", "loop", "head", "heap", "help",
+    "tail", "take", "join", "json", "eval", "even", "exit", "into",
+    "sort", "swap", "zero", "len", "let", "hex", "tan", "exp",
+    "int", "map", "max", "min", "mod", "not", "nth", "ord",
+    "set", "seq", "sin", "sum", "zip", "if", "in", "or" };
+  int count = (int)(sizeof(words) / sizeof(words[0])), k, ok;
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Prog = mpc_new("prog");
+  char grammar[1024], *text;
+  mpc_result_t r;
+  mpc_err_t *e;
+  clock_t start;
+  size_t n = 0;
+
+  strcpy(grammar, "symbol : ");
+  for (k = 0; k < count; k++) {
+    strcat(grammar, k ? " | \"" : "\"");
+    strcat(grammar, words[k]);
+    strcat(grammar, "\"");
+  }
+  strcat(grammar, "; prog : /^/ <symbol>* /$/;");
+  e = mpca_lang(MPCA_LANG_DEFAULT, grammar, Symbol, Prog, NULL);
+  if (e) { mpc_err_print(e); mpc_err_delete(e); exit(1); }
+
+  text = malloc(1000000 + 16);
+  while (n < 1000000) {
+    n += (size_t)sprintf(text + n, "%s ", words[bench_rand(count)]);
+  }
+
+  start = clock();
+  for (k = 0; k < 3; k++) {
+    ok = mpc_parse("<keywords>", text, Prog, &r);
+    bench_result(&r, ok, bench_ast_delete);
+  }
+  printf("  %d keywords, 1 MB   %.3fs per parse\n", count, bench_seconds(start) / 3);
+
+  free(text);
+  mpc_cleanup(2, Symbol, Prog);
+}
+
+/*
+** Main
+*/
+
+typedef struct {
+  const char *name;
+  const char *about;
+  void (*run)(void);
+} bench_case_t;
+
+static const bench_case_t bench_cases[] = {
+  { "any",      "many(any) throughput from 1 KB to 10 MB, which should stay flat", bench_any },
+  { "any100mb", "the same at 100 MB, skip it with -any100mb", bench_any_100mb },
+  { "mmap",     "mpc_parse_file against mpc_parse_mmap on one file", bench_mmap },
+  { "lines",    "8000 sammallus lines, one in eight failing, through one parse context", bench_lines },
+  { "labels",   "20 failing parses of an or of 4000 strings", bench_labels },
+  { "memo",     "nested expressions with and without memoized rules", bench_memo },
+  { "dispatch", "many of an or of 4, 26 and 104 alternatives", bench_dispatch },
+  { "keywords", "1 MB of words matched against a rule of 40 keywords", bench_keywords }
+};
+
+static int bench_named(int argc, char **argv, const char *name, int skip) {
+  int j;
+  for (j = 1; j < argc; j++) {
+    if ((argv[j][0] == '-') == skip && strcmp(argv[j] + skip, name) == 0) { return 1; }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int i, j, picked = 0, count = (int)(sizeof(bench_cases) / sizeof(bench_cases[0]));
+
+  for (j = 1; j < argc; j++) {
+    const char *name = argv[j] + (argv[j][0] == '-');
+    picked = picked || argv[j][0] != '-';
+    for (i = 0; i < count; i++) { if (strcmp(name, bench_cases[i].name) == 0) { break; } }
+    if (i == count) {
+      fprintf(stderr, "Unknown case '%s'. Cases are:\n", name);
+      for (i = 0; i < count; i++) { fprintf(stderr, "  %-10s %s\n", bench_cases[i].name, bench_cases[i].about); }
+      return 1;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (picked && !bench_named(argc, argv, bench_cases[i].name, 0)) { continue; }
+    if (bench_named(argc, argv, bench_cases[i].name, 1)) { continue; }
+    printf("%s: %s\n", bench_cases[i].name, bench_cases[i].about);
+    bench_seed = 1;
+    bench_cases[i].run();
+  }
+
+  return 0;
+}
@@ -1,5 +1,16 @@
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -47,7 +58,20 @@ static mpc_state_t mpc_state_new(void) {
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. The buffer is a
+** ring indexed by absolute position, holding
+** everything from the oldest live mark or the
+** cursor, whichever is earlier, up to the
+** furthest character read. Once no marks are
+** left the bytes behind the cursor are released
+** and their space reused.
+**
+** Files opened by `mpc_parse_contents` and
+** `mpc_parse_mmap` skip the File mode entirely.
+** Regular files are memory mapped and anything
+** else is read up front in large blocks, and in
+** both cases the contents are then scanned as a
+** String, without stopping at any NUL bytes.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -62,29 +86,89 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_FRAMES_MIN = 64
+};
+
+/*
+** Memory for a parse comes from slabs in six
+** size classes, 16 to 512 bytes. Each class has
+** a free list threaded through its free objects
+** and new objects are bumped off a page at a time
+** from the blocks owned by the input - first the
+** one embedded in it, then heap blocks that each
+** double the last. Every page records its class
+** so an object's size can be found from its
+** address alone. Larger requests, and any made
+** once the blocks run out, go to the heap.
+*/
+
+enum {
+  MPC_MEM_CLASSES   = 6,
+  MPC_MEM_CLASS_MIN = 16,
+  MPC_MEM_PAGE      = 1024,
+  MPC_MEM_PAGES_MIN = 32,
+  MPC_MEM_BLOCKS_MAX = 12
+};
+
+enum {
+  MPC_INPUT_BUFFER_MIN = 64
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_BLOCK_SIZE = 65536
 };
 
+typedef union {
+  char data[MPC_MEM_PAGE];
+  long l;
+  double d;
+  void *p;
+} mpc_mem_page_t;
+
+typedef struct {
+  char *data;
+  unsigned char *classes;
+  size_t pages;
+  size_t used;
+} mpc_mem_block_t;
+
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  const char *text;
+  int count;
+  int parts;
+  int parts_num;
+  unsigned long hash;
+} mpc_err_label_t;
+
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int base;
+} mpc_parse_frame_t;
+
+typedef struct mpc_memo_t mpc_memo_t;
 
 typedef struct {
 
   int type;
+  int borrowed;
   char *filename;  
   mpc_state_t state;
   
   char *string;
+  size_t length;
   char *buffer;
+  long buffer_pos;
+  size_t buffer_len;
+  size_t buffer_size;
   FILE *file;
+  void *map;
+  size_t map_len;
   
   int suppress;
   int backtrack;
+  int spans;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,67 +176,204 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  int frames_num;
+  int frames_slots;
+  mpc_parse_frame_t *frames;
+  int values_num;
+  int values_slots;
+  mpc_val_t **values;
+  
+  mpc_memo_t *memo;
+  
+  void *mem_free[MPC_MEM_CLASSES];
+  char *mem_next[MPC_MEM_CLASSES];
+  char *mem_end[MPC_MEM_CLASSES];
+  int mem_blocks_num;
+  int mem_block;
+  mpc_mem_block_t mem_blocks[MPC_MEM_BLOCKS_MAX];
+  unsigned long mem_hits;
+  unsigned long mem_fallbacks;
+  unsigned char mem_classes[MPC_MEM_PAGES_MIN];
+  mpc_mem_page_t mem[MPC_MEM_PAGES_MIN];
+  
+  long err_pos;
+  int labels_num;
+  int labels_slots;
+  mpc_err_label_t *labels;
+  int label_parts_num;
+  int label_parts_slots;
+  int *label_parts;
+  int label_table_size;
+  int *label_table;
+  
+  mpc_parse_ctx_t *ctx;
   
 } mpc_input_t;
 
+/*
+** A parse context keeps one finished input,
+** along with its marks and memory slots, so
+** the next parse through the same context can
+** skip allocating and clearing them. The spare
+** is taken out while in use, so a fold that
+** parses again with the same context just gets
+** a fresh input of its own.
+*/
+
+struct mpc_parse_ctx_t {
+  mpc_input_t *spare;
+  unsigned long mem_hits;
+  unsigned long mem_fallbacks;
+};
+
+static void mpc_mem_reset(mpc_input_t *i) {
+  int k;
+  for (k = 0; k < MPC_MEM_CLASSES; k++) {
+    i->mem_free[k] = NULL;
+    i->mem_next[k] = NULL;
+    i->mem_end[k] = NULL;
+  }
+  for (k = 0; k < i->mem_blocks_num; k++) { i->mem_blocks[k].used = 0; }
+  i->mem_block = 0;
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+}
+
+static void mpc_mem_init(mpc_input_t *i) {
+  i->mem_blocks[0].data = (char*)i->mem;
+  i->mem_blocks[0].classes = i->mem_classes;
+  i->mem_blocks[0].pages = MPC_MEM_PAGES_MIN;
+  i->mem_blocks_num = 1;
+  mpc_mem_reset(i);
+}
+
+static void mpc_mem_free_blocks(mpc_input_t *i) {
+  int k;
+  for (k = 1; k < i->mem_blocks_num; k++) { free(i->mem_blocks[k].data); }
+  i->mem_blocks_num = 1;
+}
+
+static mpc_input_t *mpc_input_new(mpc_parse_ctx_t *c) {
+  
+  mpc_input_t *i;
+  
+  if (c && c->spare) {
+    i = c->spare;
+    c->spare = NULL;
+  } else {
+    i = malloc(sizeof(mpc_input_t));
+    i->marks_slots = MPC_INPUT_MARKS_MIN;
+    i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = malloc(sizeof(char) * i->marks_slots);
+    i->frames_slots = MPC_INPUT_FRAMES_MIN;
+    i->frames = malloc(sizeof(mpc_parse_frame_t) * i->frames_slots);
+    i->values_slots = MPC_INPUT_FRAMES_MIN;
+    i->values = malloc(sizeof(mpc_val_t*) * i->values_slots);
+    i->memo = NULL;
+    mpc_mem_init(i);
+    i->labels_slots = 0;
+    i->labels = NULL;
+    i->label_parts_slots = 0;
+    i->label_parts = NULL;
+    i->label_table_size = 0;
+    i->label_table = NULL;
+  }
+  
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->spans = 0;
+  i->marks_num = 0;
+  i->frames_num = 0;
+  i->values_num = 0;
+  i->last = '\0';
+  mpc_mem_reset(i);
+  i->ctx = c;
+  
+  return i;
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(NULL);
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
+  i->borrowed = 0;
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
   i->file = NULL;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->map = NULL;
+  i->map_len = 0;
   
   return i;
 }
 
 static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(NULL);
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
+  i->borrowed = 0;
   
   i->state = mpc_state_new();
   
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
+  /* strncpy stops at the first NUL so the input ends there too */
+  i->length = strlen(i->string);
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
   i->file = NULL;
+  i->map = NULL;
+  i->map_len = 0;
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  return i;
+
+}
+
+/*
+** A view is a string input that borrows both the
+** filename and the string from the caller instead
+** of copying them, so the caller must keep them
+** alive for the duration of the parse. The string
+** need not be NUL terminated, but like nstring the
+** input ends at the first NUL within length.
+*/
+
+static mpc_input_t *mpc_input_new_view(mpc_parse_ctx_t *c, const char *filename, const char *string, size_t length) {
+
+  const char *end = memchr(string, '\0', length);
+  mpc_input_t *i = mpc_input_new(c);
+  
+  i->filename = (char*)filename;
+  i->type = MPC_INPUT_STRING;
+  i->borrowed = 1;
+  
+  i->state = mpc_state_new();
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->string = (char*)string;
+  i->length = end ? (size_t)(end - string) : length;
+  i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
+  i->file = NULL;
+  i->map = NULL;
+  i->map_len = 0;
   
   return i;
 
@@ -160,28 +381,24 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(NULL);
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   
   i->type = MPC_INPUT_PIPE;
+  i->borrowed = 0;
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
   i->file = pipe;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->map = NULL;
+  i->map_len = 0;
   
   return i;
   
@@ -189,67 +406,230 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(NULL);
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_FILE;
+  i->borrowed = 0;
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
   i->file = file;
+  i->map = NULL;
+  i->map_len = 0;
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  return i;
+}
+
+/*
+** Takes ownership of a string of the given
+** length, which unlike nstring may contain
+** NUL bytes. If map is set the string lies
+** inside a mapping that is unmapped on delete.
+*/
+
+static mpc_input_t *mpc_input_new_contents(const char *filename, char *string, size_t length, void *map, size_t map_len) {
+
+  mpc_input_t *i = mpc_input_new(NULL);
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_STRING;
+  i->borrowed = 0;
+  
+  i->state = mpc_state_new();
+  
+  i->string = string;
+  i->length = length;
+  i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_size = 0;
+  i->file = NULL;
+  i->map = map;
+  i->map_len = map_len;
   
   return i;
+
 }
 
-static void mpc_input_delete(mpc_input_t *i) {
+static mpc_input_t *mpc_input_new_block(const char *filename, FILE *file) {
   
-  free(i->filename);
+  size_t size = MPC_INPUT_BLOCK_SIZE;
+  size_t length = 0;
+  size_t n;
+  char *string = malloc(size);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  while ((n = fread(string + length, 1, size - length, file)) > 0) {
+    length += n;
+    if (length == size) {
+      size *= 2;
+      string = realloc(string, size);
+    }
+  }
+  
+  return mpc_input_new_contents(filename, string, length, NULL, 0);
+}
+
+/*
+** Maps a regular file from its current position
+** to the end. Anything that cannot be mapped
+** (pipes, terminals, empty files) falls back to
+** reading the rest of the stream in blocks.
+** Both ways leave the file positioned at its
+** end, as if it had been read through.
+*/
+
+static mpc_input_t *mpc_input_new_mmap(const char *filename, FILE *file) {
+  
+#ifdef MPC_MMAP
+  struct stat st;
+  long offset;
+  void *map;
+  
+  offset = ftell(file);
+  
+  if (offset >= 0
+  &&  fstat(fileno(file), &st) == 0
+  &&  S_ISREG(st.st_mode)
+  &&  st.st_size > offset) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map != MAP_FAILED) {
+      fseek(file, (long)st.st_size, SEEK_SET);
+      return mpc_input_new_contents(filename,
+        (char*)map + offset, (size_t)(st.st_size - offset),
+        map, (size_t)st.st_size);
+    }
+  }
+#endif
   
+  return mpc_input_new_block(filename, file);
+}
+
+static void mpc_memo_clear(mpc_input_t *i);
+
+static void mpc_input_free(mpc_input_t *i) {
+  mpc_memo_clear(i);
+  free(i->memo);
+  mpc_mem_free_blocks(i);
   free(i->marks);
   free(i->lasts);
+  free(i->frames);
+  free(i->values);
+  free(i->labels);
+  free(i->label_parts);
+  free(i->label_table);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+static void mpc_input_delete(mpc_input_t *i) {
+  
+  if (!i->borrowed) { free(i->filename); }
+  
+#ifdef MPC_MMAP
+  if (i->map) { munmap(i->map, i->map_len); }
+#endif
+  
+  if (i->type == MPC_INPUT_STRING && !i->borrowed && !i->map) { free(i->string); }
+  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  
+  if (i->ctx) {
+    i->ctx->mem_hits += i->mem_hits;
+    i->ctx->mem_fallbacks += i->mem_fallbacks;
+  }
+  
+  if (i->ctx && !i->ctx->spare) {
+    i->ctx->spare = i;
+    return;
+  }
+  
+  mpc_input_free(i);
 }
 
-static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+static mpc_mem_block_t *mpc_mem_block(mpc_input_t *i, void *p) {
+  int k;
+  mpc_mem_block_t *b;
+  if ((char*)p >= (char*)i->mem && (char*)p < (char*)(i->mem + MPC_MEM_PAGES_MIN)) {
+    return &i->mem_blocks[0];
+  }
+  for (k = 1; k < i->mem_blocks_num; k++) {
+    b = &i->mem_blocks[k];
+    if ((char*)p >= b->data && (char*)p < b->data + b->pages * MPC_MEM_PAGE) { return b; }
+  }
+  return NULL;
+}
+
+static size_t mpc_mem_size(mpc_mem_block_t *b, void *p) {
+  return (size_t)MPC_MEM_CLASS_MIN << b->classes[((char*)p - b->data) / MPC_MEM_PAGE];
+}
+
+static int mpc_mem_carve(mpc_input_t *i, int k) {
   
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  size_t pages;
+  mpc_mem_block_t *b = &i->mem_blocks[i->mem_block];
+  char *page;
   
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
+  while (b->used == b->pages) {
+    if (i->mem_block + 1 == i->mem_blocks_num) {
+      if (i->mem_blocks_num == MPC_MEM_BLOCKS_MAX) { return 0; }
+      pages = b->pages * 2;
+      b = &i->mem_blocks[i->mem_blocks_num++];
+      b->data = malloc(pages * MPC_MEM_PAGE + pages);
+      b->classes = (unsigned char*)b->data + pages * MPC_MEM_PAGE;
+      b->pages = pages;
+      b->used = 0;
     }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+    b = &i->mem_blocks[++i->mem_block];
+  }
+  
+  page = b->data + b->used * MPC_MEM_PAGE;
+  b->classes[b->used++] = (unsigned char)k;
+  i->mem_next[k] = page;
+  i->mem_end[k] = page + MPC_MEM_PAGE;
+  
+  return 1;
+}
+
+static const unsigned char mpc_mem_class[33] = {
+  0, 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5
+};
+
+static void *mpc_malloc(mpc_input_t *i, size_t n) {
+  
+  int k = 0;
+  void *p;
+  
+  if (n > (size_t)MPC_MEM_CLASS_MIN << (MPC_MEM_CLASSES-1)) {
+    i->mem_fallbacks++;
+    return malloc(n);
+  }
   
-  return malloc(n);
+  k = mpc_mem_class[(n + MPC_MEM_CLASS_MIN - 1) / MPC_MEM_CLASS_MIN];
+  
+  i->mem_hits++;
+  
+  if (i->mem_free[k]) {
+    p = i->mem_free[k];
+    i->mem_free[k] = *(void**)p;
+    return p;
+  }
+  
+  if (i->mem_next[k] == i->mem_end[k] && !mpc_mem_carve(i, k)) {
+    i->mem_hits--;
+    i->mem_fallbacks++;
+    return malloc(n);
+  }
+  
+  p = i->mem_next[k];
+  i->mem_next[k] += (size_t)MPC_MEM_CLASS_MIN << k;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -259,21 +639,27 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_mem_block_t *b = mpc_mem_block(i, p);
+  int k;
+  if (!b) { free(p); return; }
+  k = b->classes[((char*)p - b->data) / MPC_MEM_PAGE];
+  *(void**)p = i->mem_free[k];
+  i->mem_free[k] = p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  size_t size;
+  mpc_mem_block_t *b = mpc_mem_block(i, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (!b) { return realloc(p, n); }
   
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
+  size = mpc_mem_size(b, p);
+  
+  if (n > size) {
+    q = mpc_malloc(i, n);
+    memcpy(q, p, size);
     mpc_free(i, p);
     return q;
   }
@@ -283,9 +669,12 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  size_t size;
+  mpc_mem_block_t *b = mpc_mem_block(i, p);
+  if (!b) { return p; }
+  size = mpc_mem_size(b, p);
+  q = malloc(size);
+  memcpy(q, p, size);
   mpc_free(i, p);
   return q; 
 }
@@ -311,10 +700,20 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
+}
+
+static void mpc_input_buffer_release(mpc_input_t *i) {
   
+  size_t n;
+  
+  if (i->state.pos <= i->buffer_pos) { return; }
+  
+  n = (size_t)(i->state.pos - i->buffer_pos);
+  n = n < i->buffer_len ? n : i->buffer_len;
+  i->buffer_pos += (long)n;
+  i->buffer_len -= n;
+  
+  if (i->buffer_len == 0) { i->buffer_pos = i->state.pos; }
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -333,8 +732,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_release(i);
   }
   
 }
@@ -354,33 +752,59 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos >= i->buffer_pos
+    &&   i->state.pos < i->buffer_pos + (long)i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[(size_t)i->state.pos & (i->buffer_size - 1)];
+}
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  
+  char *buffer;
+  size_t size;
+  long j;
+  
+  if (i->buffer_len == 0) { i->buffer_pos = i->state.pos; }
+  
+  if (i->buffer_len == i->buffer_size) {
+    size = i->buffer_size ? i->buffer_size * 2 : MPC_INPUT_BUFFER_MIN;
+    buffer = malloc(size);
+    for (j = i->buffer_pos; j < i->buffer_pos + (long)i->buffer_len; j++) {
+      buffer[(size_t)j & (size - 1)] = i->buffer[(size_t)j & (i->buffer_size - 1)];
+    }
+    free(i->buffer);
+    i->buffer = buffer;
+    i->buffer_size = size;
+  }
+  
+  i->buffer[(size_t)i->state.pos & (i->buffer_size - 1)] = c;
+  i->buffer_len++;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i) && feof(i->file)) { return 1; }
   return 0;
 }
 
+static char mpc_input_string_at(mpc_input_t *i) {
+  return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
+}
+
 static char mpc_input_getc(mpc_input_t *i) {
   
   char c = '\0';
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return mpc_input_string_at(i);
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
         return c;
       } else {
@@ -397,7 +821,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return mpc_input_string_at(i);
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -408,14 +832,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
     
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         return mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -436,9 +853,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -452,22 +867,26 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  &&  i->marks_num > 0 && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_push(i, c);
   }
   
   i->last = c;
   i->state.pos++;
   i->state.col++;
   
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+    mpc_input_buffer_release(i);
+  }
+  
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->spans) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -494,16 +913,11 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
-}
-
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_set(mpc_input_t *i, const unsigned char *c, char **o) {
   char x = mpc_input_getc(i);
+  unsigned char u = (unsigned char)x;
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return (c[u >> 3] >> (u & 7)) & 1 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -526,11 +940,37 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
+  if (i->spans) { *o = NULL; return 1; }
+  
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
 }
 
+/*
+** Copies the text consumed since `start` out of a
+** string input. Null characters are left out, as
+** they are when the single character outputs are
+** folded together.
+*/
+
+static char *mpc_input_span(mpc_input_t *i, long start) {
+  
+  const char *s = i->string + start;
+  size_t n = (size_t)(i->state.pos - start);
+  char *o = mpc_malloc(i, n + 1), *x = o;
+  
+  if (memchr(s, '\0', n) == NULL) {
+    memcpy(o, s, n);
+    o[n] = '\0';
+    return o;
+  }
+  
+  while (n--) { if (*s) { *x++ = *s; } s++; }
+  *x = '\0';
+  return o;
+}
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   *o = NULL;
   return f(i->last, mpc_input_peekc(i));
@@ -637,217 +1077,442 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->recieved = mpc_input_peekc(i);
-  return x;
-}
+/*
+** While parsing, errors are kept as cheap
+** records - a position, the character found
+** there, and either a failure message or a set
+** of expected labels - with no strings copied.
+** Labels are interned per parse into a table
+** on the input, so each is an integer ID and
+** merging two sets only compares IDs. Plain
+** labels point at strings the parsers own, and
+** labels built by repeats such as "one or more
+** of" refer to the IDs of their parts.
+**
+** Since every error made outside of a suppressed
+** region ends up in the final merge, only the
+** ones at the furthest position so far can ever
+** be reported, and the rest are not made at all.
+** Strings are only built by mpc_err_export, when
+** the whole parse has failed.
+**
+** An error can also point at a list of plain labels
+** worked out before the parse, which are only
+** interned once the error is merged at the same
+** position or reported. Most are overtaken by an
+** error further on first, and then cost nothing.
+*/
 
-static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
-  return x;
-}
+typedef struct { char *m; unsigned long h; } mpc_err_plain_t;
 
-static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
-  mpc_err_t *x;
-  x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = mpc_state_new();
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = malloc(strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
-  return x;
-}
+typedef struct {
+  mpc_state_t state;
+  const char *failure;
+  int *expected;
+  int expected_num;
+  int expected_slots;
+  unsigned long *bits;
+  int bits_num;
+  const mpc_err_plain_t *plain;
+  int plain_num;
+  char recieved;
+} mpc_err_rec_t;
+
+enum {
+  MPC_ERR_LABEL_TABLE_MIN = 64,
+  MPC_ERR_EXPECTED_MIN = 4,
+  MPC_ERR_EXPECTED_SCAN = 8,
+  MPC_ERR_BITS = sizeof(unsigned long) * 8
+};
 
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
+static const char mpc_err_many1_prefix[] = "one or more of ";
+
+static void mpc_err_labels_reset(mpc_input_t *i) {
   int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
+  i->err_pos = 0;
+  i->labels_num = 0;
+  i->label_parts_num = 0;
+  for (j = 0; j < i->label_table_size; j++) { i->label_table[j] = -1; }
 }
 
-static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
-  }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
+static unsigned long mpc_err_label_hash_text(const char *text) {
+  unsigned long h = 5381;
+  while (*text) { h = h * 33 + (unsigned char)*text++; }
+  return h;
 }
 
-static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
+static unsigned long mpc_err_label_hash_repeat(const char *prefix, int count, const int *parts, int num) {
+  unsigned long h = prefix ? 7 : (unsigned long)count * 31 + 11;
   int j;
-  (void)i;
-  for (j = 0; j < x->expected_num; j++) {
-    if (strcmp(x->expected[j], expected) == 0) { return 1; }
+  for (j = 0; j < num; j++) { h = h * 33 + (unsigned long)parts[j]; }
+  return h;
+}
+
+static int mpc_err_label_equal(mpc_input_t *i, mpc_err_label_t *l, unsigned long hash,
+  const char *text, int count, const int *parts, int num) {
+  if (l->hash != hash || l->parts_num != num) { return 0; }
+  if (num < 0) { return l->text == text || strcmp(l->text, text) == 0; }
+  return l->text == text && l->count == count
+    && memcmp(i->label_parts + l->parts, parts, sizeof(int) * num) == 0;
+}
+
+static void mpc_err_label_table_grow(mpc_input_t *i) {
+  int j, k, size = i->label_table_size ? i->label_table_size * 2 : MPC_ERR_LABEL_TABLE_MIN;
+  free(i->label_table);
+  i->label_table = malloc(sizeof(int) * size);
+  i->label_table_size = size;
+  for (j = 0; j < size; j++) { i->label_table[j] = -1; }
+  for (j = 0; j < i->labels_num; j++) {
+    k = (int)(i->labels[j].hash & (unsigned long)(size - 1));
+    while (i->label_table[k] != -1) { k = (k + 1) & (size - 1); }
+    i->label_table[k] = j;
   }
-  return 0;
 }
 
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
+/*
+** Finds or adds a label. A plain label has a NULL
+** parts list and num of -1, a repeat label has
+** either the many1 prefix or a count. Expect
+** parsers hash their label when they are built,
+** so looking one up does not touch its text
+** unless another label has the same hash.
+*/
 
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
+static int mpc_err_label(mpc_input_t *i, unsigned long hash, const char *text, int count, const int *parts, int num) {
   
-  int j, k, fst;
-  mpc_err_t *e;
-  
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
+  int k, id;
+  mpc_err_label_t *l;
   
-  if (fst == -1) { return NULL; }
+  if (i->labels_num * 2 >= i->label_table_size) { mpc_err_label_table_grow(i); }
   
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
+  k = (int)(hash & (unsigned long)(i->label_table_size - 1));
+  while ((id = i->label_table[k]) != -1) {
+    if (mpc_err_label_equal(i, &i->labels[id], hash, text, count, parts, num)) { return id; }
+    k = (k + 1) & (i->label_table_size - 1);
+  }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
+  if (i->labels_num == i->labels_slots) {
+    i->labels_slots = i->labels_slots ? i->labels_slots * 2 : MPC_ERR_LABEL_TABLE_MIN / 2;
+    i->labels = realloc(i->labels, sizeof(mpc_err_label_t) * i->labels_slots);
   }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-    
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-    
-    e->recieved = x[j]->recieved;
-    
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
+  id = i->labels_num++;
+  i->label_table[k] = id;
+  l = &i->labels[id];
+  l->text = text;
+  l->count = count;
+  l->parts_num = num;
+  l->hash = hash;
+  l->parts = i->label_parts_num;
+  
+  if (num > 0) {
+    if (i->label_parts_num + num > i->label_parts_slots) {
+      while (i->label_parts_num + num > i->label_parts_slots) {
+        i->label_parts_slots = i->label_parts_slots ? i->label_parts_slots * 2 : MPC_ERR_LABEL_TABLE_MIN;
       }
+      i->label_parts = realloc(i->label_parts, sizeof(int) * i->label_parts_slots);
     }
+    memcpy(i->label_parts + i->label_parts_num, parts, sizeof(int) * num);
+    i->label_parts_num += num;
   }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
+  return id;
+}
+
+static size_t mpc_err_label_length(mpc_input_t *i, int id) {
+  
+  mpc_err_label_t *l = &i->labels[id];
+  int *parts = i->label_parts + l->parts;
+  size_t n;
+  int j;
+  
+  if (l->parts_num < 0) { return strlen(l->text); }
+  
+  n = l->text ? strlen(l->text) : (size_t)snprintf(NULL, 0, "%i of ", l->count);
+  for (j = 0; j < l->parts_num; j++) {
+    n += mpc_err_label_length(i, parts[j]);
+    if (j < l->parts_num - 2) { n += strlen(", "); }
+    if (j == l->parts_num - 2) { n += strlen(" or "); }
   }
   
-  return e;
+  return n;
+}
+
+static char *mpc_err_label_write(mpc_input_t *i, int id, char *out) {
+  
+  mpc_err_label_t *l = &i->labels[id];
+  int *parts = i->label_parts + l->parts;
+  int j;
+  
+  if (l->parts_num < 0) {
+    strcpy(out, l->text);
+    return out + strlen(out);
+  }
+  
+  if (l->text) { strcpy(out, l->text); } else { sprintf(out, "%i of ", l->count); }
+  out += strlen(out);
+  
+  for (j = 0; j < l->parts_num; j++) {
+    out = mpc_err_label_write(i, parts[j], out);
+    if (j < l->parts_num - 2) { strcpy(out, ", "); out += strlen(", "); }
+    if (j == l->parts_num - 2) { strcpy(out, " or "); out += strlen(" or "); }
+  }
+  
+  return out;
 }
 
-static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
+static mpc_err_rec_t *mpc_err_rec_new(mpc_input_t *i, const char *failure) {
+  mpc_err_rec_t *x = mpc_malloc(i, sizeof(mpc_err_rec_t));
+  x->state = i->state;
+  x->failure = failure;
+  x->expected = NULL;
+  x->expected_num = 0;
+  x->expected_slots = 0;
+  x->bits = NULL;
+  x->bits_num = 0;
+  x->plain = NULL;
+  x->plain_num = 0;
+  x->recieved = ' ';
+  return x;
+}
 
-  int j = 0;
-  size_t l = 0;
-  char *expect = NULL;
+static int mpc_err_live(mpc_input_t *i) {
+  if (i->suppress || i->state.pos < i->err_pos) { return 0; }
+  i->err_pos = i->state.pos;
+  return 1;
+}
+
+static mpc_err_rec_t *mpc_err_new(mpc_input_t *i, const char *expected, unsigned long hash) {
+  mpc_err_rec_t *x;
+  if (!mpc_err_live(i)) { return NULL; }
+  x = mpc_err_rec_new(i, NULL);
+  x->expected_num = 1;
+  x->expected_slots = MPC_ERR_EXPECTED_MIN;
+  x->expected = mpc_malloc(i, sizeof(int) * x->expected_slots);
+  x->expected[0] = mpc_err_label(i, hash, expected, 0, NULL, -1);
+  x->recieved = mpc_input_peekc(i);
+  return x;
+}
+
+static mpc_err_rec_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
+  if (!mpc_err_live(i)) { return NULL; }
+  return mpc_err_rec_new(i, failure);
+}
+
+static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
+  mpc_err_t *x;
+  x = malloc(sizeof(mpc_err_t));
+  x->filename = malloc(strlen(filename) + 1);
+  strcpy(x->filename, filename);
+  x->state = mpc_state_new();
+  x->expected_num = 0;
+  x->expected = NULL;
+  x->failure = malloc(strlen(failure) + 1);
+  strcpy(x->failure, failure);
+  x->recieved = ' ';
+  return x;
+}
+
+static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_rec_t *x) {
+  if (x == NULL) { return; }
+  mpc_free(i, x->bits);
+  mpc_free(i, x->expected);
+  mpc_free(i, x);
+}
+
+/*
+** Builds the error reported to the user. Labels
+** that render to the same text are only listed
+** once. Distinct IDs can only spell the same
+** thing when a plain label reads like a repeat,
+** so only those are compared.
+*/
+
+static int mpc_err_reads_as_repeat(const char *s) {
+  if (strncmp(s, mpc_err_many1_prefix, strlen(mpc_err_many1_prefix)) == 0) { return 1; }
+  if (!isdigit((unsigned char)*s)) { return 0; }
+  while (isdigit((unsigned char)*s)) { s++; }
+  return strncmp(s, " of ", 4) == 0;
+}
+
+static void mpc_err_expand(mpc_input_t *i, mpc_err_rec_t *x);
+
+static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_rec_t *y) {
   
-  if (x == NULL) { return NULL; }
+  int j, k, repeats_num = 0;
+  int *repeats = NULL;
+  char *s;
+  mpc_err_t *x = malloc(sizeof(mpc_err_t));
   
-  if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+  x->filename = malloc(strlen(i->filename) + 1);
+  strcpy(x->filename, i->filename);
+  x->state = y->state;
+  x->recieved = y->recieved;
+  x->failure = NULL;
+  x->expected = NULL;
+  x->expected_num = 0;
+  
+  mpc_err_expand(i, y);
+  
+  if (y->failure) {
+    x->failure = malloc(strlen(y->failure) + 1);
+    strcpy(x->failure, y->failure);
   }
   
-  else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
-    strcpy(expect, prefix);
-    strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
-    return x;
+  if (y->expected_num > 0) {
+    x->expected = malloc(sizeof(char*) * y->expected_num);
+    repeats = malloc(sizeof(int) * y->expected_num);
   }
   
-  else if (x->expected_num > 1) {
-    
-    l += strlen(prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      l += strlen(x->expected[j]) + strlen(", ");
-    }
-    l += strlen(x->expected[x->expected_num-2]);
-    l += strlen(" or ");
-    l += strlen(x->expected[x->expected_num-1]);
-    
-    expect = mpc_malloc(i, l + 1);
-    
-    strcpy(expect, prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      strcat(expect, x->expected[j]); strcat(expect, ", ");
+  for (j = 0; j < y->expected_num; j++) {
+    s = malloc(mpc_err_label_length(i, y->expected[j]) + 1);
+    mpc_err_label_write(i, y->expected[j], s);
+    if (mpc_err_reads_as_repeat(s)) {
+      for (k = 0; k < repeats_num; k++) {
+        if (strcmp(x->expected[repeats[k]], s) == 0) { break; }
+      }
+      if (k < repeats_num) { free(s); continue; }
+      repeats[repeats_num++] = x->expected_num;
     }
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    strcat(expect, x->expected[x->expected_num-1]);
+    x->expected[x->expected_num++] = s;
+  }
+  
+  free(repeats);
+  mpc_err_delete_internal(i, y);
+  return x;
+}
 
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-    
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+/*
+** Small expected sets are searched directly. Once
+** a set grows past a few labels it also keeps a
+** bitset over the label IDs, so joining a set of
+** n labels into it is O(n) however large it gets.
+*/
+
+static void mpc_err_set_bit(mpc_input_t *i, mpc_err_rec_t *x, int id) {
+  int n = id / MPC_ERR_BITS + 1;
+  if (n > x->bits_num) {
+    n = n > i->labels_slots / MPC_ERR_BITS + 1 ? n : i->labels_slots / MPC_ERR_BITS + 1;
+    x->bits = mpc_realloc(i, x->bits, sizeof(unsigned long) * n);
+    memset(x->bits + x->bits_num, 0, sizeof(unsigned long) * (n - x->bits_num));
+    x->bits_num = n;
+  }
+  x->bits[id / MPC_ERR_BITS] |= 1ul << (id % MPC_ERR_BITS);
+}
+
+static int mpc_err_contains_expected(mpc_err_rec_t *x, int id) {
+  int j;
+  if (x->bits) {
+    return id / MPC_ERR_BITS < x->bits_num
+      && (x->bits[id / MPC_ERR_BITS] >> (id % MPC_ERR_BITS)) & 1;
+  }
+  for (j = 0; j < x->expected_num; j++) {
+    if (x->expected[j] == id) { return 1; }
   }
+  return 0;
+}
+
+static void mpc_err_add_expected(mpc_input_t *i, mpc_err_rec_t *x, int id) {
+  int j;
+  if (x->expected_num == x->expected_slots) {
+    x->expected_slots = x->expected_slots ? x->expected_slots * 2 : MPC_ERR_EXPECTED_MIN;
+    x->expected = mpc_realloc(i, x->expected, sizeof(int) * x->expected_slots);
+  }
+  x->expected[x->expected_num++] = id;
+  if (x->bits) {
+    mpc_err_set_bit(i, x, id);
+  } else if (x->expected_num > MPC_ERR_EXPECTED_SCAN) {
+    for (j = 0; j < x->expected_num; j++) { mpc_err_set_bit(i, x, x->expected[j]); }
+  }
+}
+
+static void mpc_err_expand(mpc_input_t *i, mpc_err_rec_t *x) {
   
-  return NULL;
+  int j, id;
+  
+  if (x == NULL) { return; }
+  
+  for (j = 0; j < x->plain_num; j++) {
+    id = mpc_err_label(i, x->plain[j].h, x->plain[j].m, 0, NULL, -1);
+    if (!mpc_err_contains_expected(x, id)) { mpc_err_add_expected(i, x, id); }
+  }
+  
+  x->plain = NULL;
+  x->plain_num = 0;
 }
 
-static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
-  return mpc_err_repeat(i, x, "one or more of ");
+/*
+** Merging keeps whichever error is further along.
+** At the same position the first failure message
+** wins, and otherwise the expected sets are joined
+** in order, so this gives the same result as the
+** original merge without building a new error.
+*/
+
+static mpc_err_rec_t *mpc_err_merge(mpc_input_t *i, mpc_err_rec_t *x, mpc_err_rec_t *y) {
+  
+  int j;
+  
+  if (x == NULL) { return y; }
+  if (y == NULL) { return x; }
+  
+  if (y->state.pos > x->state.pos) {
+    mpc_err_delete_internal(i, x);
+    return y;
+  }
+  
+  if (y->state.pos == x->state.pos && !x->failure) {
+    mpc_err_expand(i, x);
+    if (y->failure) {
+      x->failure = y->failure;
+    } else {
+      mpc_err_expand(i, y);
+      x->recieved = y->recieved;
+      for (j = 0; j < y->expected_num; j++) {
+        if (!mpc_err_contains_expected(x, y->expected[j])) {
+          mpc_err_add_expected(i, x, y->expected[j]);
+        }
+      }
+    }
+  }
+  
+  mpc_err_delete_internal(i, y);
+  return x;
 }
 
-static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix;
-  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(i, x, prefix);
-  mpc_free(i, prefix);
-  return y;
+static mpc_err_rec_t *mpc_err_repeat(mpc_input_t *i, mpc_err_rec_t *x, const char *prefix, int count) {
+  
+  int label;
+  
+  if (x == NULL) { return NULL; }
+  
+  /* Behind the furthest error this will never be reported */
+  if (x->state.pos < i->err_pos) { return x; }
+  
+  mpc_err_expand(i, x);
+  
+  if (x->expected_num == 0) {
+    label = mpc_err_label(i, mpc_err_label_hash_text(""), "", 0, NULL, -1);
+    mpc_err_add_expected(i, x, label);
+    return x;
+  }
+  
+  label = mpc_err_label(i, mpc_err_label_hash_repeat(prefix, count, x->expected, x->expected_num),
+    prefix, count, x->expected, x->expected_num);
+  mpc_free(i, x->bits);
+  x->bits = NULL;
+  x->bits_num = 0;
+  x->expected_num = 1;
+  x->expected[0] = label;
+  return x;
+}
+
+static mpc_err_rec_t *mpc_err_many1(mpc_input_t *i, mpc_err_rec_t *x) {
+  return mpc_err_repeat(i, x, mpc_err_many1_prefix, 0);
 }
 
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
+static mpc_err_rec_t *mpc_err_count(mpc_input_t *i, mpc_err_rec_t *x, int n) {
+  return mpc_err_repeat(i, x, NULL, n);
 }
 
 /*
@@ -866,36 +1531,56 @@ enum {
 
   MPC_TYPE_ANY        = 8,
   MPC_TYPE_SINGLE     = 9,
-  MPC_TYPE_ONEOF      = 10,
-  MPC_TYPE_NONEOF     = 11,
-  MPC_TYPE_RANGE      = 12,
-  MPC_TYPE_SATISFY    = 13,
-  MPC_TYPE_STRING     = 14,
-
-  MPC_TYPE_APPLY      = 15,
-  MPC_TYPE_APPLY_TO   = 16,
-  MPC_TYPE_PREDICT    = 17,
-  MPC_TYPE_NOT        = 18,
-  MPC_TYPE_MAYBE      = 19,
-  MPC_TYPE_MANY       = 20,
-  MPC_TYPE_MANY1      = 21,
-  MPC_TYPE_COUNT      = 22,
-
-  MPC_TYPE_OR         = 23,
-  MPC_TYPE_AND        = 24,
-
-  MPC_TYPE_CHECK      = 25,
-  MPC_TYPE_CHECK_WITH = 26
+  MPC_TYPE_SET        = 10,
+  MPC_TYPE_RANGE      = 11,
+  MPC_TYPE_SATISFY    = 12,
+  MPC_TYPE_STRING     = 13,
+
+  MPC_TYPE_APPLY      = 14,
+  MPC_TYPE_APPLY_TO   = 15,
+  MPC_TYPE_PREDICT    = 16,
+  MPC_TYPE_NOT        = 17,
+  MPC_TYPE_MAYBE      = 18,
+  MPC_TYPE_MANY       = 19,
+  MPC_TYPE_MANY1      = 20,
+  MPC_TYPE_COUNT      = 21,
+
+  MPC_TYPE_OR         = 22,
+  MPC_TYPE_AND        = 23,
+
+  MPC_TYPE_CHECK      = 24,
+  MPC_TYPE_CHECK_WITH = 25,
+  
+  MPC_TYPE_DFA        = 26,
+  MPC_TYPE_MEMO       = 27,
+  MPC_TYPE_TRIE       = 28
+};
+
+/*
+** Character sets are a 256-bit bitmap indexed
+** by the unsigned value of the input character.
+** Sets folded from an `or` by `mpc_optimise` keep
+** the original alternatives in `xs` so that on a
+** miss they can be rerun to report exactly the
+** same errors the `or` would have. Tries folded
+** from an `or` of strings keep them in the same way.
+*/
+
+enum {
+  MPC_SET_BYTES = 32
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
-typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
+typedef struct { mpc_parser_t *x; char *m; unsigned long h; } mpc_pdata_expect_t;
 typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { unsigned char *x; int n; mpc_parser_t **xs; } mpc_pdata_set_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct mpc_trie_t mpc_trie_t;
+typedef struct { mpc_trie_t *t; int n; mpc_parser_t **xs; } mpc_pdata_trie_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -903,9 +1588,14 @@ typedef struct { mpc_parser_t *x; mpc_check_with_t f; void *d; char *e; } mpc_pd
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct mpc_dispatch_t mpc_dispatch_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_dispatch_t *d; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
+typedef struct mpc_dfa_t mpc_dfa_t;
+typedef struct { mpc_dfa_t *d; mpc_parser_t *x; mpc_parser_t *a; mpc_parser_t *y; mpc_parser_t *z; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t cp; mpc_dtor_t dx; } mpc_pdata_memo_t;
+
 typedef union {
   mpc_pdata_fail_t fail;
   mpc_pdata_lift_t lift;
@@ -913,8 +1603,10 @@ typedef union {
   mpc_pdata_anchor_t anchor;
   mpc_pdata_single_t single;
   mpc_pdata_range_t range;
+  mpc_pdata_set_t set;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_trie_t trie;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_check_t check;
@@ -924,15 +1616,142 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char *name;
   mpc_pdata_t data;
+  unsigned long generation;
   char type;
   char retained;
+  char span;
+};
+
+/*
+** Spans
+**
+** A parser marked as text outputs exactly the text
+** it consumed, and one marked as rewind consumes
+** nothing when it fails. Repeats and sequences that
+** are text are run on string inputs without building
+** outputs for their parts, and the result is copied
+** out of the input once they succeed.
+** Because of this every part a text parser can run
+** has to be text as well.
+**
+** Retained parsers can be redefined, so they never
+** count towards the marks of the parsers using them.
+*/
+
+enum {
+  MPC_SPAN_TEXT   = 1,
+  MPC_SPAN_REWIND = 2,
+  MPC_SPAN_BOTH   = 3
 };
 
+static int mpc_span_of(mpc_parser_t *p) {
+  return p->retained ? 0 : p->span;
+}
+
+static int mpc_span_zero_width(mpc_parser_t *p) {
+  while (p->type == MPC_TYPE_EXPECT && !p->retained) { p = p->data.expect.x; }
+  return p->type == MPC_TYPE_ANCHOR && !p->retained;
+}
+
+static void mpc_span_update(mpc_parser_t *p) {
+  
+  int j, s;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SET:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_TRIE:
+      p->span = MPC_SPAN_BOTH;
+      break;
+    
+    case MPC_TYPE_LIFT:
+      p->span = p->data.lift.lf == mpcf_ctor_str ? MPC_SPAN_BOTH : 0;
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      p->span = mpc_span_of(p->data.expect.x);
+      break;
+    
+    case MPC_TYPE_DFA:
+      p->span = mpc_span_of(p->data.dfa.x);
+      break;
+    
+    case MPC_TYPE_MEMO:
+      p->span = mpc_span_of(p->data.memo.x);
+      break;
+    
+    /* A failed part is only skipped if it consumed nothing */
+    
+    case MPC_TYPE_NOT:
+      p->span = p->data.not.lf == mpcf_ctor_str
+        && mpc_span_of(p->data.not.x) == MPC_SPAN_BOTH ? MPC_SPAN_BOTH : 0;
+      break;
+    
+    case MPC_TYPE_MAYBE:
+      p->span = p->data.not.lf == mpcf_ctor_str
+        && mpc_span_of(p->data.not.x) == MPC_SPAN_BOTH ? MPC_SPAN_BOTH : 0;
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      p->span = p->data.repeat.f == mpcf_strfold
+        && mpc_span_of(p->data.repeat.x) == MPC_SPAN_BOTH ? MPC_SPAN_BOTH : 0;
+      break;
+    
+    /* A count that fails part way through is not rewound */
+    
+    case MPC_TYPE_COUNT:
+      s = mpc_span_of(p->data.repeat.x);
+      p->span = p->data.repeat.f == mpcf_strfold
+        && p->data.repeat.n >= 1 && (s & MPC_SPAN_TEXT)
+        ? (p->data.repeat.n == 1 ? s : MPC_SPAN_TEXT) : 0;
+      break;
+    
+    case MPC_TYPE_OR:
+      s = p->data.or.n > 0 ? MPC_SPAN_BOTH : 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        if (j < p->data.or.n-1 && !(mpc_span_of(p->data.or.xs[j]) & MPC_SPAN_REWIND)) { s = 0; }
+        s &= mpc_span_of(p->data.or.xs[j]);
+      }
+      p->span = s;
+      break;
+    
+    /* Zero width assertions from regexes are also text */
+    
+    case MPC_TYPE_AND:
+      s = p->data.and.n > 0 ? MPC_SPAN_BOTH : MPC_SPAN_REWIND;
+      if (p->data.and.f == mpcf_snd && p->data.and.n == 2
+      &&  mpc_span_zero_width(p->data.and.xs[0])) {
+        s &= mpc_span_of(p->data.and.xs[1]) | MPC_SPAN_REWIND;
+      } else if (p->data.and.f == mpcf_strfold) {
+        for (j = 0; j < p->data.and.n; j++) {
+          s &= mpc_span_of(p->data.and.xs[j]) | MPC_SPAN_REWIND;
+        }
+      } else {
+        s = MPC_SPAN_REWIND;
+      }
+      p->span = s;
+      break;
+    
+    default:
+      p->span = 0;
+      break;
+  }
+  
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -945,11 +1764,18 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
+  char *o;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  o = xs[0] = mpc_realloc(i, xs[0], l + 1);
+  o += strlen(o);
+  for (j = 1; j < n; j++) {
+    k = strlen(xs[j]);
+    memcpy(o, xs[j], k + 1);
+    o += k;
+    mpc_free(i, xs[j]);
+  }
   return xs[0];
 }
 
@@ -964,6 +1790,7 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
 
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
+  if (i->spans)            { return NULL; }
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
   if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
   if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -977,48 +1804,1831 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   return f(j, xs);
 }
 
-static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
-  return NULL;
-}
+static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
+  mpc_free(i, x);
+  return NULL;
+}
+
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_free(i, c);
+  return a;
+}
+
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  return f(mpc_export(i, x));
+}
+
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  return f(mpc_export(i, x), d);
+}
+
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (d == free) { mpc_free(i, x); return; }
+  d(mpc_export(i, x));
+}
+
+enum {
+  MPC_PARSE_FAILURE = 0,
+  MPC_PARSE_SUCCESS = 1,
+  MPC_PARSE_CALL    = 2
+};
+
+static void mpc_parse_frame_push(mpc_input_t *i, mpc_parser_t *p) {
+  
+  mpc_parse_frame_t *f;
+  
+  if (i->frames_num == i->frames_slots) {
+    i->frames_slots = i->frames_slots + i->frames_slots / 2;
+    i->frames = realloc(i->frames, sizeof(mpc_parse_frame_t) * i->frames_slots);
+  }
+  
+  f = &i->frames[i->frames_num++];
+  f->p = p;
+  f->j = 0;
+  f->base = i->values_num;
+}
+
+static void mpc_parse_value_push(mpc_input_t *i, mpc_val_t *x) {
+  if (i->values_num == i->values_slots) {
+    i->values_slots = i->values_slots + i->values_slots / 2;
+    i->values = realloc(i->values, sizeof(mpc_val_t*) * i->values_slots);
+  }
+  i->values[i->values_num++] = x;
+}
+
+typedef union {
+  mpc_err_rec_t *error;
+  mpc_val_t *output;
+} mpc_run_result_t;
+
+/*
+** Packrat Memoization
+**
+** Parsers marked with `mpc_memoize` record what
+** they did at each position of a string input, in
+** a table of fixed size on the input keyed by the
+** parser, the position, and whether errors are
+** suppressed or backtracking is off. A later run
+** at the same place skips straight to the recorded
+** end state, gets a copy of the recorded output,
+** and makes the same errors again. A slot that is
+** needed by another key is simply overwritten.
+**
+** Outputs can only be recorded when the parser was
+** given a way to copy them, otherwise just failures
+** are. Inside a span there are no outputs to copy,
+** and there the parser runs as normal.
+*/
+
+enum {
+  MPC_MEMO_SLOTS   = 4096,
+  MPC_MEMO_PENDING = -1
+};
+
+struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int mode;
+  int x;
+  mpc_state_t state;
+  char last;
+  long err_pos;
+  mpc_val_t *output;
+  mpc_err_rec_t *e;
+  mpc_err_rec_t *r;
+};
+
+static mpc_err_rec_t *mpc_err_copy(mpc_input_t *i, mpc_err_rec_t *x) {
+  
+  mpc_err_rec_t *y;
+  
+  if (x == NULL) { return NULL; }
+  
+  y = mpc_malloc(i, sizeof(mpc_err_rec_t));
+  *y = *x;
+  
+  if (x->expected) {
+    y->expected = mpc_malloc(i, sizeof(int) * x->expected_slots);
+    memcpy(y->expected, x->expected, sizeof(int) * x->expected_num);
+  }
+  
+  if (x->bits) {
+    y->bits = mpc_malloc(i, sizeof(unsigned long) * x->bits_num);
+    memcpy(y->bits, x->bits, sizeof(unsigned long) * x->bits_num);
+  }
+  
+  return y;
+}
+
+/*
+** The errors a memoized parser merges into `e` are
+** collected on their own and joined in afterwards.
+** A collected error can carry both expected labels
+** and the failure that came after them, so unlike
+** `mpc_err_merge` the labels are joined before the
+** failure is taken, which is what merging each of
+** them in turn would have done.
+*/
+
+static mpc_err_rec_t *mpc_err_join(mpc_input_t *i, mpc_err_rec_t *x, mpc_err_rec_t *y) {
+  
+  int j;
+  
+  if (x == NULL) { return y; }
+  if (y == NULL) { return x; }
+  
+  if (y->state.pos > x->state.pos) {
+    mpc_err_delete_internal(i, x);
+    return y;
+  }
+  
+  if (y->state.pos == x->state.pos && !x->failure) {
+    mpc_err_expand(i, x);
+    mpc_err_expand(i, y);
+    if (!y->failure || y->expected_num > 0) { x->recieved = y->recieved; }
+    for (j = 0; j < y->expected_num; j++) {
+      if (!mpc_err_contains_expected(x, y->expected[j])) {
+        mpc_err_add_expected(i, x, y->expected[j]);
+      }
+    }
+    x->failure = y->failure;
+  }
+  
+  mpc_err_delete_internal(i, y);
+  return x;
+}
+
+static void mpc_memo_evict(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->x == MPC_PARSE_SUCCESS && m->output) { m->p->data.memo.dx(m->output); }
+  mpc_err_delete_internal(i, m->e);
+  mpc_err_delete_internal(i, m->r);
+  m->p = NULL;
+  m->output = NULL;
+  m->e = NULL;
+  m->r = NULL;
+}
+
+static void mpc_memo_clear(mpc_input_t *i) {
+  int k;
+  if (i->memo == NULL) { return; }
+  for (k = 0; k < MPC_MEMO_SLOTS; k++) { mpc_memo_evict(i, &i->memo[k]); }
+}
+
+static int mpc_memo_slot(mpc_parser_t *p, long pos, int mode) {
+  unsigned long h = (unsigned long)(size_t)p / sizeof(mpc_parser_t);
+  h = (h * 31 + (unsigned long)pos) * 4 + (unsigned long)mode;
+  h ^= h >> 13;
+  h *= 2654435761ul;
+  return (int)((h ^ (h >> 16)) & (MPC_MEMO_SLOTS - 1));
+}
+
+static int mpc_memo_replay(mpc_input_t *i, mpc_memo_t *m, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  i->state = m->state;
+  i->last = m->last;
+  if (m->err_pos > i->err_pos) { i->err_pos = m->err_pos; }
+  *e = mpc_err_join(i, *e, mpc_err_copy(i, m->e));
+  
+  if (m->x == MPC_PARSE_SUCCESS) {
+    r->output = m->output ? m->p->data.memo.cp(m->output) : NULL;
+  } else {
+    r->error = mpc_err_copy(i, m->r);
+  }
+  
+  return m->x;
+}
+
+/*
+** Either replays a recorded result, or claims the
+** slot and runs the parser with the errors made so
+** far put aside on the value stack. The frame holds
+** the slot, or -1 when the result is not recorded.
+*/
+
+static int mpc_memo_enter(mpc_input_t *i, mpc_parser_t *p, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  int k = -1, mode;
+  mpc_memo_t *m;
+  
+  if (i->type == MPC_INPUT_STRING && !i->spans) {
+    
+    mode = (i->suppress ? 1 : 0) | (i->backtrack >= 1 ? 2 : 0);
+    if (i->memo == NULL) { i->memo = calloc(MPC_MEMO_SLOTS, sizeof(mpc_memo_t)); }
+    
+    k = mpc_memo_slot(p, i->state.pos, mode);
+    m = &i->memo[k];
+    
+    if (m->p == p && m->pos == i->state.pos && m->mode == mode && m->x != MPC_MEMO_PENDING) {
+      return mpc_memo_replay(i, m, r, e);
+    }
+    
+    mpc_memo_evict(i, m);
+    m->p = p;
+    m->pos = i->state.pos;
+    m->mode = mode;
+    m->x = MPC_MEMO_PENDING;
+  }
+  
+  mpc_parse_frame_push(i, p);
+  i->frames[i->frames_num-1].j = k;
+  
+  if (k >= 0) {
+    mpc_parse_value_push(i, *e);
+    *e = NULL;
+  }
+  
+  return MPC_PARSE_CALL;
+}
+
+/*
+** Records the result unless the slot was taken by
+** something run in the meantime. Outputs recorded
+** are moved off the input's own memory first, as
+** the copy kept has to outlive it.
+*/
+
+static int mpc_memo_leave(mpc_input_t *i, mpc_parse_frame_t *f, int x, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  mpc_pdata_memo_t *d = &f->p->data.memo;
+  mpc_memo_t *m;
+  mpc_err_rec_t *s;
+  
+  if (f->j < 0) { return x; }
+  
+  s = i->values[f->base];
+  i->values_num = f->base;
+  m = &i->memo[f->j];
+  
+  if (m->p == f->p && m->x == MPC_MEMO_PENDING) {
+    if (x && d->cp == NULL) {
+      m->p = NULL;
+    } else {
+      m->x = x;
+      m->state = i->state;
+      m->last = i->last;
+      m->err_pos = i->err_pos;
+      m->e = mpc_err_copy(i, *e);
+      if (x) {
+        r->output = mpc_export(i, r->output);
+        m->output = r->output ? d->cp(r->output) : NULL;
+      } else {
+        m->r = mpc_err_copy(i, r->error);
+      }
+    }
+  }
+  
+  *e = mpc_err_join(i, s, *e);
+  return x;
+}
+
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
+
+/*
+** Compiled Regular Expressions
+**
+** Regexes in which every choice is decided by the
+** next character are compiled by `mpc_re` into a
+** DFA, which is built in full from a Thompson NFA
+** when the regex is compiled. For such regexes the
+** backtracking parse always stops at the last point
+** where the DFA accepted, so a match is one scan
+** over the input and one copy of the span. Regexes
+** that need too many states are left as trees.
+**
+** Errors still have to be the ones the tree would
+** report. When the scan gets stuck these can only
+** be made at the stuck position, and they depend on
+** nothing but the state it got stuck in and whether
+** it accepted on the way, so the tree is run once
+** for each of those over the shortest text that gets
+** there, and the labels it reports are recorded to
+** be replayed. States where the tree reports anything
+** else fall back to running the tree. Nothing in the
+** DFA changes once it is built, so any number of
+** parses can share it.
+*/
+
+enum {
+  MPC_NFA_SET   = 0,
+  MPC_NFA_SPLIT = 1,
+  MPC_NFA_MATCH = 2
+};
+
+enum {
+  MPC_NFA_MAX = 4096,
+  MPC_DFA_STATES_MIN = 8,
+  MPC_DFA_STATES_MAX = 512,
+  MPC_DFA_UNKNOWN = -2,
+  MPC_DFA_DEAD = -1
+};
+
+typedef struct {
+  int type;
+  int out;
+  int out1;
+  unsigned char set[MPC_SET_BYTES];
+} mpc_nfa_state_t;
+
+typedef struct {
+  const char *text;
+  int count;
+  int num;
+  int *parts;
+  unsigned long hash;
+} mpc_dfa_label_t;
+
+typedef struct {
+  int valid;
+  int labels_num;
+  int parts_max;
+  mpc_dfa_label_t *labels;
+  int e_num;
+  int *e;
+  int r_num;
+  int *r;
+} mpc_dfa_error_t;
+
+typedef struct {
+  int set;
+  int num;
+  int accept;
+  int leaves;
+  unsigned long hash;
+  mpc_dfa_error_t *errors[2];
+} mpc_dfa_state_t;
+
+struct mpc_dfa_t {
+  
+  mpc_nfa_state_t *nfa;
+  int nfa_num;
+  int nfa_slots;
+  
+  int *start;
+  int start_num;
+  
+  mpc_dfa_state_t *states;
+  int states_num;
+  int states_slots;
+  int *trans;
+  
+  int *sets;
+  int sets_num;
+  int sets_slots;
+  
+  int *table;
+  int table_size;
+  
+  unsigned int *stamps;
+  unsigned int stamp;
+  int *work;
+  int *stack;
+  
+  int shell;
+  int broken;
+};
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_run_result_t *r, mpc_err_rec_t **e);
+
+static void mpc_dfa_error_delete(mpc_dfa_error_t *x) {
+  int j;
+  if (x == NULL) { return; }
+  for (j = 0; j < x->labels_num; j++) { free(x->labels[j].parts); }
+  free(x->labels);
+  free(x->e);
+  free(x->r);
+  free(x);
+}
+
+static int mpc_dfa_int_cmp(const void *a, const void *b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+/*
+** Follows the splits from a list of NFA states and
+** writes the sorted set of states it reaches into
+** `out`, which may be the same list it started from.
+*/
+
+static int mpc_dfa_closure(mpc_dfa_t *d, const int *xs, int n, int *out) {
+  
+  int j, s, top = 0, m = 0;
+  
+  if (++d->stamp == 0) {
+    memset(d->stamps, 0, sizeof(unsigned int) * d->nfa_num);
+    d->stamp = 1;
+  }
+  
+  for (j = 0; j < n; j++) {
+    if (d->stamps[xs[j]] != d->stamp) {
+      d->stamps[xs[j]] = d->stamp;
+      d->stack[top++] = xs[j];
+    }
+  }
+  
+  while (top > 0) {
+    s = d->stack[--top];
+    if (d->nfa[s].type != MPC_NFA_SPLIT) { out[m++] = s; continue; }
+    if (d->stamps[d->nfa[s].out] != d->stamp) {
+      d->stamps[d->nfa[s].out] = d->stamp;
+      d->stack[top++] = d->nfa[s].out;
+    }
+    if (d->stamps[d->nfa[s].out1] != d->stamp) {
+      d->stamps[d->nfa[s].out1] = d->stamp;
+      d->stack[top++] = d->nfa[s].out1;
+    }
+  }
+  
+  qsort(out, m, sizeof(int), mpc_dfa_int_cmp);
+  return m;
+}
+
+static unsigned long mpc_dfa_set_hash(const int *xs, int n) {
+  unsigned long h = 5381;
+  int j;
+  for (j = 0; j < n; j++) { h = h * 33 + (unsigned long)xs[j]; }
+  return h;
+}
+
+static void mpc_dfa_table_grow(mpc_dfa_t *d) {
+  int j, k, size = d->table_size ? d->table_size * 2 : MPC_DFA_STATES_MIN * 2;
+  free(d->table);
+  d->table = malloc(sizeof(int) * size);
+  d->table_size = size;
+  for (j = 0; j < size; j++) { d->table[j] = -1; }
+  for (j = 0; j < d->states_num; j++) {
+    k = (int)(d->states[j].hash & (unsigned long)(size - 1));
+    while (d->table[k] != -1) { k = (k + 1) & (size - 1); }
+    d->table[k] = j;
+  }
+}
+
+/*
+** Finds or adds the state for a set of NFA states,
+** returning -1 when the DFA is already full.
+*/
+
+static int mpc_dfa_add(mpc_dfa_t *d, const int *xs, int n) {
+  
+  int j, k, id;
+  unsigned long h = mpc_dfa_set_hash(xs, n);
+  mpc_dfa_state_t *s;
+  
+  if (d->states_num * 2 >= d->table_size) { mpc_dfa_table_grow(d); }
+  
+  k = (int)(h & (unsigned long)(d->table_size - 1));
+  while ((id = d->table[k]) != -1) {
+    s = &d->states[id];
+    if (s->hash == h && s->num == n
+    &&  memcmp(d->sets + s->set, xs, sizeof(int) * n) == 0) { return id; }
+    k = (k + 1) & (d->table_size - 1);
+  }
+  
+  if (d->states_num == MPC_DFA_STATES_MAX) { return -1; }
+  
+  if (d->states_num == d->states_slots) {
+    d->states_slots = d->states_slots ? d->states_slots * 2 : MPC_DFA_STATES_MIN;
+    d->states = realloc(d->states, sizeof(mpc_dfa_state_t) * d->states_slots);
+    d->trans = realloc(d->trans, sizeof(int) * 256 * d->states_slots);
+  }
+  
+  if (d->sets_num + n > d->sets_slots) {
+    while (d->sets_num + n > d->sets_slots) {
+      d->sets_slots = d->sets_slots ? d->sets_slots * 2 : MPC_DFA_STATES_MIN * 8;
+    }
+    d->sets = realloc(d->sets, sizeof(int) * d->sets_slots);
+  }
+  
+  id = d->states_num++;
+  d->table[k] = id;
+  s = &d->states[id];
+  s->set = d->sets_num;
+  s->num = n;
+  s->accept = 0;
+  s->leaves = 0;
+  s->hash = h;
+  s->errors[0] = NULL;
+  s->errors[1] = NULL;
+  
+  memcpy(d->sets + d->sets_num, xs, sizeof(int) * n);
+  d->sets_num += n;
+  
+  for (j = 0; j < n; j++) {
+    if (d->nfa[xs[j]].type == MPC_NFA_MATCH) { s->accept = 1; }
+    if (d->nfa[xs[j]].type == MPC_NFA_SET)   { s->leaves = 1; }
+  }
+  
+  for (j = 0; j < 256; j++) { d->trans[id * 256 + j] = MPC_DFA_UNKNOWN; }
+  
+  return id;
+}
+
+/*
+** Works out the transition from state `q` on `c`,
+** returning -1 when the DFA would need too many
+** states.
+*/
+
+static int mpc_dfa_next(mpc_dfa_t *d, int q, unsigned char c) {
+  
+  int j, t, n = 0;
+  mpc_dfa_state_t *s = &d->states[q];
+  mpc_nfa_state_t *x;
+  
+  for (j = 0; j < s->num; j++) {
+    x = &d->nfa[d->sets[s->set + j]];
+    if (x->type == MPC_NFA_SET && (x->set[c >> 3] >> (c & 7)) & 1) {
+      d->work[n++] = x->out;
+    }
+  }
+  
+  if (n == 0) {
+    d->trans[q * 256 + c] = MPC_DFA_DEAD;
+    return MPC_DFA_DEAD;
+  }
+  
+  n = mpc_dfa_closure(d, d->work, n, d->work);
+  t = mpc_dfa_add(d, d->work, n);
+  if (t == -1) { return -1; }
+  
+  d->trans[q * 256 + c] = t;
+  return t;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j;
+  for (j = 0; j < d->states_num; j++) {
+    mpc_dfa_error_delete(d->states[j].errors[0]);
+    mpc_dfa_error_delete(d->states[j].errors[1]);
+  }
+  free(d->nfa);
+  free(d->start);
+  free(d->states);
+  free(d->trans);
+  free(d->sets);
+  free(d->table);
+  free(d->stamps);
+  free(d->work);
+  free(d->stack);
+  free(d);
+}
+
+static void mpc_dfa_shell_delete(mpc_parser_t *p) {
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  free(p->name);
+  free(p);
+}
+
+static void mpc_dfa_advance(mpc_state_t *s, const char *string, long pos) {
+  while (s->pos < pos) {
+    s->col++;
+    if (string[s->pos++] == '\n') {
+      s->col = 0;
+      s->row++;
+    }
+  }
+}
+
+/*
+** Copies the labels of an error made on the scratch
+** input, parts first, so they can be interned again
+** in order on the real one.
+*/
+
+static int mpc_dfa_error_label(mpc_dfa_error_t *x, mpc_input_t *t, int *map, int id) {
+  
+  mpc_err_label_t *l = &t->labels[id];
+  mpc_dfa_label_t *y;
+  int j, *parts;
+  
+  if (map[id] != -1) { return map[id]; }
+  
+  parts = l->parts_num > 0 ? malloc(sizeof(int) * l->parts_num) : NULL;
+  for (j = 0; j < l->parts_num; j++) {
+    parts[j] = mpc_dfa_error_label(x, t, map, t->label_parts[l->parts + j]);
+  }
+  
+  y = &x->labels[x->labels_num];
+  y->text = l->text;
+  y->count = l->count;
+  y->num = l->parts_num;
+  y->parts = parts;
+  y->hash = l->hash;
+  x->parts_max = l->parts_num > x->parts_max ? l->parts_num : x->parts_max;
+  
+  map[id] = x->labels_num;
+  return x->labels_num++;
+}
+
+static int *mpc_dfa_error_list(mpc_dfa_error_t *x, mpc_input_t *t, int *map, mpc_err_rec_t *y, int *num) {
+  
+  int j, *list;
+  
+  if (y == NULL) { *num = -1; return NULL; }
+  
+  list = malloc(sizeof(int) * y->expected_num);
+  for (j = 0; j < y->expected_num; j++) {
+    list[j] = mpc_dfa_error_label(x, t, map, y->expected[j]);
+  }
+  
+  *num = y->expected_num;
+  return list;
+}
+
+/*
+** An error at the stuck position can be replayed if
+** it only has expected labels. One further back can
+** be left out when there is one at the stuck position
+** too, as the two are always merged before anything
+** is reported.
+*/
+
+static int mpc_dfa_error_usable(mpc_err_rec_t *y, long pos) {
+  if (y == NULL || y->state.pos < pos) { return 1; }
+  return y->state.pos == pos && !y->failure && y->expected_num > 0 ? 2 : 0;
+}
+
+/*
+** Runs the tree over `text`, on whose end the DFA
+** gets stuck having last accepted at `last`, to
+** record the errors it makes there. A tree that
+** disagrees with the DFA about the match marks the
+** DFA as broken instead.
+*/
+
+static mpc_dfa_error_t *mpc_dfa_error_new(mpc_pdata_dfa_t *p, const char *text, long n, long last) {
+  
+  int j, *map, ue, uf;
+  mpc_input_t *t;
+  mpc_run_result_t r;
+  mpc_err_rec_t *e = NULL, *f = NULL;
+  mpc_dfa_error_t *x = NULL;
+  
+  t = mpc_input_new_view(NULL, "<mpc_dfa>", text, (size_t)n);
+  t->length = (size_t)n;
+  mpc_err_labels_reset(t);
+  
+  if (mpc_parse_run(t, p->y, &r, &e)) {
+    mpc_free(t, r.output);
+    if (last < 0 || t->state.pos != last) { p->d->broken = 1; }
+  } else {
+    f = r.error;
+    if (last >= 0) { p->d->broken = 1; }
+  }
+  
+  mpc_err_expand(t, e);
+  mpc_err_expand(t, f);
+  
+  if (!p->d->broken) {
+    ue = mpc_dfa_error_usable(e, n);
+    uf = mpc_dfa_error_usable(f, n);
+    x = calloc(1, sizeof(mpc_dfa_error_t));
+    x->valid = ue && uf && (ue == 2 || uf == 2 || (e == NULL && f == NULL));
+    x->e_num = -1;
+    x->r_num = -1;
+  }
+  
+  if (x && x->valid) {
+    map = malloc(sizeof(int) * (t->labels_num ? t->labels_num : 1));
+    for (j = 0; j < t->labels_num; j++) { map[j] = -1; }
+    x->labels = malloc(sizeof(mpc_dfa_label_t) * (t->labels_num ? t->labels_num : 1));
+    x->e = mpc_dfa_error_list(x, t, map, ue == 2 ? e : NULL, &x->e_num);
+    x->r = mpc_dfa_error_list(x, t, map, uf == 2 ? f : NULL, &x->r_num);
+    free(map);
+  }
+  
+  mpc_err_delete_internal(t, e);
+  mpc_err_delete_internal(t, f);
+  mpc_input_delete(t);
+  return x;
+}
+
+static mpc_err_rec_t *mpc_dfa_error_rec(mpc_input_t *i, const int *list, int num, const int *ids, mpc_state_t state, char c) {
+  
+  int j;
+  mpc_err_rec_t *x;
+  
+  if (num < 0) { return NULL; }
+  
+  x = mpc_err_rec_new(i, NULL);
+  x->state = state;
+  x->recieved = c;
+  for (j = 0; j < num; j++) {
+    if (!mpc_err_contains_expected(x, ids[list[j]])) {
+      mpc_err_add_expected(i, x, ids[list[j]]);
+    }
+  }
+  
+  return x;
+}
+
+/*
+** Interns the recorded labels on the real input and
+** rebuilds the errors at the stuck position, merging
+** one into `e` and returning the other as the error
+** of a failed match.
+*/
+
+static mpc_err_rec_t *mpc_dfa_error_replay(mpc_input_t *i, mpc_dfa_error_t *x, long pos, mpc_err_rec_t **e) {
+  
+  int j, k, *ids, *parts;
+  mpc_dfa_label_t *l;
+  mpc_state_t state = i->state;
+  mpc_err_rec_t *f;
+  char c = pos < (long)i->length ? i->string[pos] : '\0';
+  
+  if (x->e_num < 0 && x->r_num < 0) { return NULL; }
+  
+  ids = mpc_malloc(i, sizeof(int) * (x->labels_num + x->parts_max + 1));
+  parts = ids + x->labels_num;
+  
+  for (j = 0; j < x->labels_num; j++) {
+    l = &x->labels[j];
+    if (l->num < 0) {
+      ids[j] = mpc_err_label(i, l->hash, l->text, 0, NULL, -1);
+      continue;
+    }
+    for (k = 0; k < l->num; k++) { parts[k] = ids[l->parts[k]]; }
+    ids[j] = mpc_err_label(i, mpc_err_label_hash_repeat(l->text, l->count, parts, l->num),
+      l->text, l->count, parts, l->num);
+  }
+  
+  mpc_dfa_advance(&state, i->string, pos);
+  i->err_pos = pos;
+  
+  *e = mpc_err_merge(i, *e, mpc_dfa_error_rec(i, x->e, x->e_num, ids, state, c));
+  f = mpc_dfa_error_rec(i, x->r, x->r_num, ids, state, c);
+  
+  mpc_free(i, ids);
+  return f;
+}
+
+static int mpc_dfa_match(mpc_input_t *i, mpc_pdata_dfa_t *p, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  mpc_dfa_t *d = p->d;
+  const unsigned char *s = (const unsigned char*)i->string;
+  long start = i->state.pos, pos = start, end = (long)i->length;
+  long last = d->states[0].accept ? start : -1;
+  int q = 0, t;
+  mpc_dfa_error_t *x;
+  mpc_err_rec_t *f = NULL;
+  
+  while (pos < end) {
+    t = d->trans[q * 256 + s[pos]];
+    if (t == MPC_DFA_DEAD) { break; }
+    q = t;
+    pos++;
+    if (d->states[q].accept) { last = pos; }
+  }
+  
+  /* Only a state that reads on can make errors where it stops */
+  if (d->states[q].leaves && !i->suppress && pos >= i->err_pos) {
+    x = d->states[q].errors[last >= 0];
+    if (x == NULL || !x->valid) { return mpc_parse_run(i, p->y, r, e); }
+    f = mpc_dfa_error_replay(i, x, pos, e);
+  }
+  
+  if (last < 0) {
+    r->error = f;
+    return 0;
+  }
+  
+  mpc_dfa_advance(&i->state, i->string, last);
+  if (last > start) { i->last = i->string[last - 1]; }
+  
+  r->output = i->spans ? NULL : mpc_input_span(i, start);
+  return 1;
+}
+
+/*
+** Runs the anchors around the DFA just as the `and`
+** they came from would, so a failing end anchor
+** rewinds past the match.
+*/
+
+static int mpc_dfa_run(mpc_input_t *i, mpc_pdata_dfa_t *p, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  mpc_state_t state = i->state;
+  char last = i->last;
+  mpc_val_t *o;
+  
+  if (p->a) {
+    if (!mpc_parse_run(i, p->a, r, e)) { return 0; }
+    mpc_free(i, r->output);
+  }
+  
+  if (!mpc_dfa_match(i, p, r, e)) { return 0; }
+  
+  if (p->z) {
+    o = r->output;
+    if (!mpc_parse_run(i, p->z, r, e)) {
+      i->state = state;
+      i->last = last;
+      mpc_free(i, o);
+      return 0;
+    }
+    mpc_free(i, r->output);
+    r->output = o;
+  }
+  
+  return 1;
+}
+
+/*
+** Runs a repeat or sequence marked as text with the
+** outputs of its parts switched off. Errors are made
+** just as in `mpc_parse_run`, and the output is only
+** copied out of the input by the outermost span.
+*/
+
+static int mpc_parse_span(mpc_input_t *i, mpc_parser_t *p, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  int j = 0, x = 1;
+  long start = i->state.pos;
+  mpc_run_result_t q;
+  
+  i->spans++;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      while (mpc_parse_run(i, p->data.repeat.x, &q, e)) { j++; }
+      if (p->type == MPC_TYPE_MANY1 && j == 0) {
+        r->error = mpc_err_many1(i, q.error);
+        x = 0;
+      } else {
+        *e = mpc_err_merge(i, *e, q.error);
+      }
+      break;
+    
+    case MPC_TYPE_COUNT:
+      while (j < p->data.repeat.n && mpc_parse_run(i, p->data.repeat.x, &q, e)) { j++; }
+      if (j < p->data.repeat.n) {
+        r->error = mpc_err_count(i, q.error, p->data.repeat.n);
+        x = 0;
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &q, e)) {
+          mpc_input_rewind(i);
+          r->error = q.error;
+          x = 0;
+          break;
+        }
+      }
+      if (x) { mpc_input_unmark(i); }
+      break;
+    
+    default: break;
+  }
+  
+  i->spans--;
+  
+  if (x) { r->output = i->spans ? NULL : mpc_input_span(i, start); }
+  return x;
+}
+
+/*
+** Keyword Tries
+**
+** An `or` of strings and characters is folded by
+** `mpc_optimise` into a trie that reads each input
+** character once. Like the `or` it matches the first
+** alternative that can, not the longest, so every
+** node knows the first alternative ending at it or
+** below it, and reading stops once nothing below
+** could come before what has been matched already.
+** The first character is looked up in a table and
+** the rest in sorted lists of siblings.
+*/
+
+typedef struct {
+  int c;
+  int child;
+  int sibling;
+  int match;
+  int below;
+  int text;
+} mpc_trie_node_t;
+
+struct mpc_trie_t {
+  int n;
+  int root[256];
+  mpc_trie_node_t *nodes;
+  int nodes_num;
+  int nodes_slots;
+  char *texts;
+  int texts_num;
+  int texts_slots;
+};
+
+static void mpc_set_add(unsigned char *x, mpc_parser_t *p);
+
+static void mpc_trie_delete(mpc_trie_t *t) {
+  if (t == NULL) { return; }
+  free(t->nodes);
+  free(t->texts);
+  free(t);
+}
+
+static int mpc_trie_node(mpc_trie_t *t, int c) {
+  
+  mpc_trie_node_t *x;
+  
+  if (t->nodes_num == t->nodes_slots) {
+    t->nodes_slots = t->nodes_slots ? t->nodes_slots * 2 : 16;
+    t->nodes = realloc(t->nodes, sizeof(mpc_trie_node_t) * t->nodes_slots);
+  }
+  
+  x = &t->nodes[t->nodes_num];
+  x->c = c;
+  x->child = 0;
+  x->sibling = 0;
+  x->match = -1;
+  x->below = -1;
+  x->text = -1;
+  return t->nodes_num++;
+}
+
+static int mpc_trie_child(mpc_trie_t *t, int x, int c) {
+  
+  int j, k = 0, y;
+  
+  if (x == 0) {
+    if (t->root[c] == 0) { t->root[c] = mpc_trie_node(t, c); }
+    return t->root[c];
+  }
+  
+  for (j = t->nodes[x].child; j && t->nodes[j].c < c; j = t->nodes[j].sibling) { k = j; }
+  if (j && t->nodes[j].c == c) { return j; }
+  
+  y = mpc_trie_node(t, c);
+  t->nodes[y].sibling = j;
+  if (k) { t->nodes[k].sibling = y; } else { t->nodes[x].child = y; }
+  return y;
+}
+
+/*
+** Adds the text `s` for the next alternative. Since
+** they are added in order only the first to reach
+** a node is kept there.
+*/
+
+static void mpc_trie_add(mpc_trie_t *t, const char *s, int len) {
+  
+  int x = 0, k;
+  
+  if (t->nodes[0].below < 0) { t->nodes[0].below = t->n; }
+  
+  for (k = 0; k < len; k++) {
+    x = mpc_trie_child(t, x, (unsigned char)s[k]);
+    if (t->nodes[x].below < 0) { t->nodes[x].below = t->n; }
+  }
+  
+  if (t->nodes[x].match >= 0) { return; }
+  
+  if (t->texts_num + len + 1 > t->texts_slots) {
+    t->texts_slots = (t->texts_num + len + 1) * 2;
+    t->texts = realloc(t->texts, t->texts_slots);
+  }
+  
+  t->nodes[x].match = t->n;
+  t->nodes[x].text = t->texts_num;
+  memcpy(t->texts + t->texts_num, s, len);
+  t->texts[t->texts_num + len] = '\0';
+  t->texts_num += len + 1;
+}
+
+/*
+** Alternatives from a trie folded into this one are
+** added one by one, so that their own order is kept.
+** The characters of a set can never be prefixes of
+** each other and share a place in the order.
+*/
+
+static void mpc_trie_add_parser(mpc_trie_t *t, mpc_parser_t *p) {
+  
+  unsigned char x[MPC_SET_BYTES];
+  int c;
+  char s;
+  
+  if (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  
+  if (p->type == MPC_TYPE_TRIE) {
+    for (c = 0; c < p->data.trie.n; c++) {
+      mpc_trie_add_parser(t, p->data.trie.xs[c]);
+    }
+    return;
+  }
+  
+  if (p->type == MPC_TYPE_STRING) {
+    mpc_trie_add(t, p->data.string.x, (int)strlen(p->data.string.x));
+    t->n++;
+    return;
+  }
+  
+  memset(x, 0, MPC_SET_BYTES);
+  mpc_set_add(x, p);
+  for (c = 0; c < 256; c++) {
+    if ((x[c >> 3] >> (c & 7)) & 1) {
+      s = (char)c;
+      mpc_trie_add(t, &s, 1);
+    }
+  }
+  t->n++;
+}
+
+static mpc_trie_t *mpc_trie_new(int n, mpc_parser_t **xs) {
+  
+  int j;
+  mpc_trie_t *t = calloc(1, sizeof(mpc_trie_t));
+  
+  mpc_trie_node(t, 0);
+  for (j = 0; j < n; j++) { mpc_trie_add_parser(t, xs[j]); }
+  
+  for (j = 0; j < t->nodes_num; j++) {
+    if (t->nodes[j].match < 0) { t->nodes[j].match = t->n; }
+    if (t->nodes[j].below < 0) { t->nodes[j].below = t->n; }
+  }
+  
+  return t;
+}
+
+/*
+** Reading on past a match for an earlier alternative
+** that then fails, or up to the end of a file, means
+** rewinding and reading the match again.
+*/
+
+static int mpc_input_trie(mpc_input_t *i, mpc_trie_t *t, char **o) {
+  
+  mpc_trie_node_t *x = t->nodes;
+  const char *text = NULL;
+  int best = t->n, depth = 0, k = 0, j, end = 0;
+  char c;
+  
+  mpc_input_mark(i);
+  
+  while (x->below < best) {
+    
+    c = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { end = 1; break; }
+    
+    if (x == t->nodes) {
+      j = t->root[(unsigned char)c];
+    } else {
+      j = x->child;
+      while (j && t->nodes[j].c < (unsigned char)c) { j = t->nodes[j].sibling; }
+      if (j && t->nodes[j].c != (unsigned char)c) { j = 0; }
+    }
+    
+    if (j == 0 || t->nodes[j].below >= best) {
+      mpc_input_failure(i, c);
+      break;
+    }
+    
+    mpc_input_success(i, c, NULL);
+    x = &t->nodes[j];
+    depth++;
+    
+    if (x->match < best) {
+      best = x->match;
+      text = t->texts + x->text;
+      k = depth;
+    }
+  }
+  
+  if (best == t->n) {
+    mpc_input_rewind(i);
+    return 0;
+  }
+  
+  if (depth > k || end) {
+    mpc_input_rewind(i);
+    for (j = 0; j < k; j++) { mpc_input_success(i, mpc_input_getc(i), NULL); }
+  } else {
+    mpc_input_unmark(i);
+  }
+  
+  if (i->spans) { *o = NULL; return 1; }
+  
+  *o = mpc_malloc(i, strlen(text) + 1);
+  strcpy(*o, text);
+  return 1;
+}
+
+/*
+** Runs a character or string parser, returning -1
+** for any other type. Tries are left to run their
+** alternatives in predictive mode, see below.
+*/
+
+static int mpc_parse_primitive(mpc_input_t *i, mpc_parser_t *p, char **o) {
+  switch (p->type) {
+    case MPC_TYPE_ANY:     return mpc_input_any(i, o);
+    case MPC_TYPE_SINGLE:  return mpc_input_char(i, p->data.single.x, o);
+    case MPC_TYPE_RANGE:   return mpc_input_range(i, p->data.range.x, p->data.range.y, o);
+    case MPC_TYPE_SET:     return mpc_input_set(i, p->data.set.x, o);
+    case MPC_TYPE_SATISFY: return mpc_input_satisfy(i, p->data.satisfy.f, o);
+    case MPC_TYPE_STRING:  return mpc_input_string(i, p->data.string.x, o);
+    case MPC_TYPE_TRIE:    return i->backtrack > 0 ? mpc_input_trie(i, p->data.trie.t, o) : -1;
+    default: return -1;
+  }
+}
+
+/*
+** First Sets
+**
+** An optimised `or` keeps a table of which of its
+** alternatives can get past the next character,
+** found from the characters each one can start
+** with. Those that cannot would fail there without
+** consuming anything, so they are skipped. While
+** their errors could still be kept only those that
+** fail with nothing but a few expected labels are
+** skipped, and the labels of each run of them that
+** can be passed over on a character are merged into
+** one list when the table is built. Skipped parsers
+** are never run, and so errors come out just as
+** before at a cost that does not grow with them.
+**
+** Tables look through retained parsers, so each
+** one notes the generation of those it used, which
+** defining or undefining them moves on. A table that
+** is out of date is left alone by the parse, and is
+** built again by `mpc_define` or `mpc_optimise`.
+** Labels are copied into the table, as optimising
+** the parsers they came from may free them.
+*/
+
+struct mpc_dispatch_t {
+  mpc_parser_t **deps;
+  unsigned long *seen;
+  int deps_num;
+  int deps_slots;
+  int *start;
+  int *list;
+  int *keep_start;
+  int *keep;
+  int *runs;
+  int *plan;
+  int *plan_num;
+  mpc_err_plain_t *labels;
+  int labels_num;
+  int labels_slots;
+  mpc_err_plain_t *merged;
+  int merged_num;
+  int merged_slots;
+};
+
+enum {
+  MPC_FIRST_NULL   = 1,
+  MPC_FIRST_DEPTH  = 64,
+  MPC_FIRST_NODES  = 4096,
+  MPC_FIRST_SOLID  = 8,
+  MPC_FIRST_LABELS = 64,
+  MPC_FIRST_DEPS   = 32
+};
+
+typedef struct {
+  mpc_dispatch_t *d;
+  mpc_parser_t *stack[MPC_FIRST_DEPTH];
+  int num;
+  int nodes;
+} mpc_first_t;
+
+static void mpc_dispatch_clear(mpc_dispatch_t *d) {
+  int j;
+  for (j = 0; j < d->labels_num; j++) { free(d->labels[j].m); }
+  free(d->deps);
+  free(d->seen);
+  free(d->start);
+  free(d->list);
+  free(d->keep_start);
+  free(d->keep);
+  free(d->runs);
+  free(d->plan);
+  free(d->plan_num);
+  free(d->labels);
+  free(d->merged);
+  memset(d, 0, sizeof(mpc_dispatch_t));
+}
+
+static void mpc_dispatch_delete(mpc_dispatch_t *d) {
+  if (d == NULL) { return; }
+  mpc_dispatch_clear(d);
+  free(d);
+}
+
+static void mpc_dispatch_dep(mpc_dispatch_t *d, mpc_parser_t *p) {
+  
+  int j;
+  
+  if (d == NULL || !p->retained) { return; }
+  
+  for (j = 0; j < d->deps_num; j++) {
+    if (d->deps[j] == p) { return; }
+  }
+  
+  if (d->deps_num == d->deps_slots) {
+    d->deps_slots = d->deps_slots ? d->deps_slots * 2 : MPC_ERR_EXPECTED_MIN;
+    d->deps = realloc(d->deps, sizeof(mpc_parser_t*) * d->deps_slots);
+    d->seen = realloc(d->seen, sizeof(unsigned long) * d->deps_slots);
+  }
+  
+  d->deps[d->deps_num] = p;
+  d->seen[d->deps_num] = p->generation;
+  d->deps_num++;
+}
+
+static int mpc_dispatch_fresh(mpc_dispatch_t *d) {
+  int j;
+  for (j = 0; j < d->deps_num; j++) {
+    if (d->deps[j]->generation != d->seen[j]) { return 0; }
+  }
+  return 1;
+}
+
+static int mpc_first_any(unsigned char *set) {
+  memset(set, 0xFF, MPC_SET_BYTES);
+  return MPC_FIRST_NULL;
+}
+
+/*
+** Parsers that always succeed without consuming or
+** making errors, which are passed over when making
+** the failure of a sequence again.
+*/
+
+static int mpc_first_empty(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_PASS
+    || p->type == MPC_TYPE_STATE
+    || p->type == MPC_TYPE_LIFT_VAL
+    || (p->type == MPC_TYPE_LIFT
+    && (p->data.lift.lf == mpcf_ctor_null || p->data.lift.lf == mpcf_ctor_str));
+}
+
+static int mpc_first(mpc_first_t *t, mpc_parser_t *p, unsigned char *set);
+
+/*
+** Adds the characters `p` can start with to `set`
+** and returns `MPC_FIRST_NULL` if it can succeed
+** without consuming. On any other character it
+** fails without consuming, or if nullable succeeds
+** without consuming. Parsers whose result depends
+** on more than the next character are given every
+** character.
+*/
+
+static int mpc_first_of(mpc_first_t *t, mpc_parser_t *p, unsigned char *set) {
+  
+  int j, f;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SET:
+      mpc_set_add(set, p);
+      return 0;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(set, 0xFF, MPC_SET_BYTES);
+      return 0;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return MPC_FIRST_NULL; }
+      j = (unsigned char)p->data.string.x[0];
+      set[j >> 3] |= 1 << (j & 7);
+      return 0;
+    
+    case MPC_TYPE_TRIE:
+      for (j = 0; j < 256; j++) {
+        if (p->data.trie.t->root[j]) { set[j >> 3] |= 1 << (j & 7); }
+      }
+      return 0;
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+      return 0;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      return MPC_FIRST_NULL;
+    
+    case MPC_TYPE_EXPECT:   return mpc_first(t, p->data.expect.x, set);
+    case MPC_TYPE_APPLY:    return mpc_first(t, p->data.apply.x, set);
+    case MPC_TYPE_APPLY_TO: return mpc_first(t, p->data.apply_to.x, set);
+    case MPC_TYPE_PREDICT:  return mpc_first(t, p->data.predict.x, set);
+    case MPC_TYPE_MEMO:     return mpc_first(t, p->data.memo.x, set);
+    case MPC_TYPE_DFA:      return mpc_first(t, p->data.dfa.x, set);
+    
+    /* A check can still fail on an empty match */
+    
+    case MPC_TYPE_CHECK:
+      f = mpc_first(t, p->data.check.x, set);
+      return f ? mpc_first_any(set) : 0;
+    
+    case MPC_TYPE_CHECK_WITH:
+      f = mpc_first(t, p->data.check_with.x, set);
+      return f ? mpc_first_any(set) : 0;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      f = mpc_first(t, p->data.not.x, set);
+      return f && p->type == MPC_TYPE_NOT ? mpc_first_any(set) : MPC_FIRST_NULL;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      f = mpc_first(t, p->data.repeat.x, set);
+      if (f) { return mpc_first_any(set); }
+      return p->type == MPC_TYPE_MANY ? MPC_FIRST_NULL : 0;
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n < 1) { return mpc_first_any(set); }
+      return mpc_first(t, p->data.repeat.x, set);
+    
+    case MPC_TYPE_OR:
+      f = p->data.or.n == 0 ? MPC_FIRST_NULL : 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        f |= mpc_first(t, p->data.or.xs[j], set);
+      }
+      return f;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first(t, p->data.and.xs[j], set)) { return 0; }
+      }
+      return MPC_FIRST_NULL;
+    
+    default: return mpc_first_any(set);
+  }
+  
+}
+
+static int mpc_first(mpc_first_t *t, mpc_parser_t *p, unsigned char *set) {
+  
+  int j, f;
+  
+  if (++t->nodes > MPC_FIRST_NODES) { return mpc_first_any(set); }
+  if (!p->retained) { return mpc_first_of(t, p, set); }
+  
+  mpc_dispatch_dep(t->d, p);
+  
+  /* Left recursion */
+  for (j = 0; j < t->num; j++) {
+    if (t->stack[j] == p) { return mpc_first_any(set); }
+  }
+  
+  if (t->num == MPC_FIRST_DEPTH) { return mpc_first_any(set); }
+  
+  t->stack[t->num++] = p;
+  f = mpc_first_of(t, p, set);
+  t->num--;
+  return f;
+}
+
+/*
+** Whether `p` can never succeed without consuming,
+** judged from the parser itself without following
+** it far.
+*/
+
+static int mpc_first_solid(mpc_dispatch_t *d, mpc_parser_t *p, int depth) {
+  
+  int j;
+  
+  if (depth > MPC_FIRST_SOLID) { return 0; }
+  
+  mpc_dispatch_dep(d, p);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SET:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_TRIE:
+      return 1;
+    
+    case MPC_TYPE_STRING: return p->data.string.x[0] != '\0';
+    
+    case MPC_TYPE_EXPECT:     return mpc_first_solid(d, p->data.expect.x, depth+1);
+    case MPC_TYPE_APPLY:      return mpc_first_solid(d, p->data.apply.x, depth+1);
+    case MPC_TYPE_APPLY_TO:   return mpc_first_solid(d, p->data.apply_to.x, depth+1);
+    case MPC_TYPE_CHECK:      return mpc_first_solid(d, p->data.check.x, depth+1);
+    case MPC_TYPE_CHECK_WITH: return mpc_first_solid(d, p->data.check_with.x, depth+1);
+    case MPC_TYPE_PREDICT:    return mpc_first_solid(d, p->data.predict.x, depth+1);
+    case MPC_TYPE_MEMO:       return mpc_first_solid(d, p->data.memo.x, depth+1);
+    case MPC_TYPE_DFA:        return mpc_first_solid(d, p->data.dfa.x, depth+1);
+    case MPC_TYPE_MANY1:      return mpc_first_solid(d, p->data.repeat.x, depth+1);
+    
+    case MPC_TYPE_COUNT:
+      return p->data.repeat.n >= 1 && mpc_first_solid(d, p->data.repeat.x, depth+1);
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_first_solid(d, p->data.or.xs[j], depth+1)) { return 0; }
+      }
+      return p->data.or.n > 0;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (mpc_first_solid(d, p->data.and.xs[j], depth+1)) { return 1; }
+      }
+      return 0;
+    
+    default: return 0;
+  }
+  
+}
+
+/*
+** Lists the labels `p` would expect when it fails
+** because it cannot start with the next character,
+** if that is all it would do there. With `sure` set
+** `p` is known to fail, otherwise it may succeed
+** without consuming. Labels are only listed once,
+** as merging would leave them.
+*/
+
+static int mpc_first_plan(mpc_dispatch_t *d, int start, mpc_parser_t *p, int sure, int depth) {
+  
+  int j;
+  mpc_err_plain_t *l;
+  
+  if (depth > MPC_FIRST_DEPTH) { return 0; }
+  
+  mpc_dispatch_dep(d, p);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_STRING: return p->data.string.x[0] != '\0';
+    
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+      return 1;
+    
+    /* A folded set or trie that misses reruns its alternatives */
+    
+    case MPC_TYPE_SET:
+      for (j = 0; j < p->data.set.n; j++) {
+        if (!mpc_first_plan(d, start, p->data.set.xs[j], 1, depth+1)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_TRIE:
+      for (j = 0; j < p->data.trie.n; j++) {
+        if (!mpc_first_plan(d, start, p->data.trie.xs[j], 1, depth+1)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_EXPECT:
+      
+      if (!sure && !mpc_first_solid(d, p->data.expect.x, 0)) { return 0; }
+      
+      for (j = start; j < d->labels_num; j++) {
+        l = &d->labels[j];
+        if (l->h == p->data.expect.h && strcmp(l->m, p->data.expect.m) == 0) {
+          return 1;
+        }
+      }
+      
+      if (d->labels_num - start == MPC_FIRST_LABELS) { return 0; }
+      
+      if (d->labels_num == d->labels_slots) {
+        d->labels_slots = d->labels_slots ? d->labels_slots * 2 : MPC_ERR_EXPECTED_MIN;
+        d->labels = realloc(d->labels, sizeof(mpc_err_plain_t) * d->labels_slots);
+      }
+      
+      l = &d->labels[d->labels_num++];
+      l->m = malloc(strlen(p->data.expect.m) + 1);
+      strcpy(l->m, p->data.expect.m);
+      l->h = p->data.expect.h;
+      return 1;
+    
+    case MPC_TYPE_APPLY:      return mpc_first_plan(d, start, p->data.apply.x, sure, depth+1);
+    case MPC_TYPE_APPLY_TO:   return mpc_first_plan(d, start, p->data.apply_to.x, sure, depth+1);
+    case MPC_TYPE_CHECK:      return mpc_first_plan(d, start, p->data.check.x, sure, depth+1);
+    case MPC_TYPE_CHECK_WITH: return mpc_first_plan(d, start, p->data.check_with.x, sure, depth+1);
+    case MPC_TYPE_MEMO:       return mpc_first_plan(d, start, p->data.memo.x, sure, depth+1);
+    case MPC_TYPE_PREDICT:    return mpc_first_plan(d, start, p->data.predict.x, sure, depth+1);
+    
+    case MPC_TYPE_OR:
+      if (!sure && !mpc_first_solid(d, p, 0)) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_first_plan(d, start, p->data.or.xs[j], 1, depth+1)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n && mpc_first_empty(p->data.and.xs[j]); j++) {}
+      if (j == p->data.and.n) { return 0; }
+      return mpc_first_plan(d, start, p->data.and.xs[j], 0, depth+1);
+    
+    default: return 0;
+  }
+  
+}
+
+/*
+** Merges the labels of alternatives `a` up to `b`,
+** returning where they start in `merged`. Their
+** text stays owned by `labels`.
+*/
+
+static int mpc_dispatch_merge(mpc_dispatch_t *d, int a, int b) {
+  
+  int j, m, k, start = d->merged_num;
+  mpc_err_plain_t *l;
+  
+  for (j = a; j < b; j++) {
+    for (m = 0; m < d->plan_num[j]; m++) {
+      
+      l = &d->labels[d->plan[j] + m];
+      for (k = start; k < d->merged_num; k++) {
+        if (d->merged[k].h == l->h && strcmp(d->merged[k].m, l->m) == 0) { break; }
+      }
+      if (k < d->merged_num) { continue; }
+      
+      if (d->merged_num == d->merged_slots) {
+        d->merged_slots = d->merged_slots ? d->merged_slots * 2 : MPC_FIRST_LABELS;
+        d->merged = realloc(d->merged, sizeof(mpc_err_plain_t) * d->merged_slots);
+      }
+      d->merged[d->merged_num++] = *l;
+    }
+  }
+  
+  return start;
+}
+
+/*
+** Lists the alternatives that can be run on each
+** character, or none if there is no character any
+** of them can be skipped on. While errors are kept
+** those without a plan are run on every character,
+** and for each character the runs skipped before,
+** between and after the ones listed get a merged
+** list of labels. Characters that list the same
+** alternatives share the lists.
+*/
+
+static void mpc_dispatch_build(mpc_parser_t *p) {
+  
+  int j, c, b, k, m, at, n = p->data.or.n;
+  mpc_dispatch_t *d = p->data.or.d;
+  unsigned char *sets, *x;
+  mpc_first_t t;
+  
+  if (d == NULL) {
+    d = calloc(1, sizeof(mpc_dispatch_t));
+    p->data.or.d = d;
+  }
+  
+  mpc_dispatch_clear(d);
+  
+  sets = calloc(n, MPC_SET_BYTES);
+  t.d = d;
+  t.num = 0;
+  t.nodes = 0;
+  
+  k = 0;
+  for (j = 0; j < n; j++) {
+    x = sets + j * MPC_SET_BYTES;
+    if (mpc_first(&t, p->data.or.xs[j], x)) { mpc_first_any(x); }
+    for (c = 0; c < 256; c++) { k += (x[c >> 3] >> (c & 7)) & 1; }
+  }
+  
+  d->plan = malloc(sizeof(int) * n);
+  d->plan_num = malloc(sizeof(int) * n);
+  
+  for (j = 0; j < n; j++) {
+    d->plan[j] = d->labels_num;
+    d->plan_num[j] = -1;
+    if (mpc_first_plan(d, d->plan[j], p->data.or.xs[j], 1, 0)) {
+      d->plan_num[j] = d->labels_num - d->plan[j];
+    } else {
+      while (d->labels_num > d->plan[j]) { free(d->labels[--d->labels_num].m); }
+    }
+  }
+  
+  /* Checking many parsers on every run would cost more than it saves */
+  if (k == n * 256 || d->deps_num > MPC_FIRST_DEPS) {
+    mpc_dispatch_clear(d);
+    free(sets);
+    return;
+  }
+  
+  d->start = malloc(sizeof(int) * 257);
+  d->list = malloc(sizeof(int) * (k > 0 ? k : 1));
+  
+  k = 0;
+  for (c = 0; c < 256; c++) {
+    d->start[c] = k;
+    for (j = 0; j < n; j++) {
+      x = sets + j * MPC_SET_BYTES;
+      if ((x[c >> 3] >> (c & 7)) & 1) { d->list[k++] = j; }
+    }
+  }
+  d->start[256] = k;
+  
+  for (j = 0; j < n; j++) {
+    if (d->plan_num[j] < 0) { mpc_first_any(sets + j * MPC_SET_BYTES); }
+  }
+  
+  d->keep_start = malloc(sizeof(int) * 257);
+  d->keep = malloc(sizeof(int) * n * 256);
+  
+  k = 0;
+  for (c = 0; c < 256; c++) {
+    d->keep_start[c] = k;
+    for (j = 0; j < n; j++) {
+      x = sets + j * MPC_SET_BYTES;
+      if ((x[c >> 3] >> (c & 7)) & 1) { d->keep[k++] = j; }
+    }
+  }
+  d->keep_start[256] = k;
+  
+  /* Two numbers for each run, the first label and the count */
+  d->runs = malloc(sizeof(int) * 2 * (k + 256));
+  
+  for (c = 0; c < 256; c++) {
+    
+    m = d->keep_start[c+1] - d->keep_start[c];
+    at = 2 * (d->keep_start[c] + c);
+    
+    for (b = 0; b < c; b++) {
+      if (d->keep_start[b+1] - d->keep_start[b] == m
+      &&  memcmp(d->keep + d->keep_start[b], d->keep + d->keep_start[c], sizeof(int) * m) == 0) { break; }
+    }
+    
+    if (b < c) {
+      memcpy(d->runs + at, d->runs + 2 * (d->keep_start[b] + b), sizeof(int) * 2 * (m + 1));
+      continue;
+    }
+    
+    for (j = 0; j <= m; j++) {
+      k = j == 0 ? 0 : d->keep[d->keep_start[c] + j - 1] + 1;
+      d->runs[at + 2*j] = mpc_dispatch_merge(d, k, j < m ? d->keep[d->keep_start[c] + j] : n);
+      d->runs[at + 2*j + 1] = d->merged_num - d->runs[at + 2*j];
+    }
+  }
+  
+  free(sets);
+}
+
+/*
+** Builds again the out of date tables of every `or`
+** that is part of `p`.
+*/
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  mpc_free(i, c);
-  return a;
+static void mpc_dispatch_refresh(mpc_parser_t *p, int force) {
+  
+  int j;
+  
+  if (p->retained && !force) { return; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:     mpc_dispatch_refresh(p->data.expect.x, 0); break;
+    case MPC_TYPE_APPLY:      mpc_dispatch_refresh(p->data.apply.x, 0); break;
+    case MPC_TYPE_APPLY_TO:   mpc_dispatch_refresh(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_CHECK:      mpc_dispatch_refresh(p->data.check.x, 0); break;
+    case MPC_TYPE_CHECK_WITH: mpc_dispatch_refresh(p->data.check_with.x, 0); break;
+    case MPC_TYPE_PREDICT:    mpc_dispatch_refresh(p->data.predict.x, 0); break;
+    case MPC_TYPE_MEMO:       mpc_dispatch_refresh(p->data.memo.x, 0); break;
+    case MPC_TYPE_DFA:        mpc_dispatch_refresh(p->data.dfa.x, 0); break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_dispatch_refresh(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_dispatch_refresh(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_SET:
+      for (j = 0; j < p->data.set.n; j++) { mpc_dispatch_refresh(p->data.set.xs[j], 0); }
+      break;
+    
+    case MPC_TYPE_TRIE:
+      for (j = 0; j < p->data.trie.n; j++) { mpc_dispatch_refresh(p->data.trie.xs[j], 0); }
+      break;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_dispatch_refresh(p->data.and.xs[j], 0); }
+      break;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_dispatch_refresh(p->data.or.xs[j], 0); }
+      if (p->data.or.d && !mpc_dispatch_fresh(p->data.or.d)) { mpc_dispatch_build(p); }
+      break;
+    
+    default: break;
+  }
+  
 }
 
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
-}
+/*
+** Makes the error of alternatives that were passed
+** over, when it could still be kept.
+*/
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+static void mpc_dispatch_fail(mpc_input_t *i, const mpc_err_plain_t *l, int num, unsigned char c, mpc_err_rec_t **e) {
+  
+  mpc_err_rec_t *y;
+  
+  if (num == 0 || !mpc_err_live(i)) { return; }
+  
+  y = mpc_err_rec_new(i, NULL);
+  y->recieved = (char)c;
+  y->plain = l;
+  y->plain_num = num;
+  *e = mpc_err_merge(i, *e, y);
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
-}
+/*
+** Finds the first alternative from `j` on that can
+** be run on the next character, failing the ones
+** passed over if their errors could still be kept.
+** Normally `j` follows the last one run on the same
+** character, so the merged labels of the run from
+** there can be used. An alternative that consumed
+** before failing leaves the input on some other
+** character, and then the labels of each one passed
+** over are used in turn.
+*/
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+static int mpc_dispatch_next(mpc_input_t *i, mpc_parser_t *p, int j, mpc_err_rec_t **e) {
+  
+  mpc_dispatch_t *d = p->data.or.d;
+  int *x, *first, *end, k, at;
+  unsigned char c;
+  
+  if (d == NULL || d->start == NULL || !mpc_dispatch_fresh(d)) { return j; }
+  
+  c = (unsigned char)mpc_input_peekc(i);
+  
+  if (i->suppress || i->state.pos < i->err_pos) {
+    x = d->list + d->start[c];
+    end = d->list + d->start[c+1];
+    while (x < end && *x < j) { x++; }
+    return x < end ? *x : p->data.or.n;
+  }
+  
+  first = d->keep + d->keep_start[c];
+  end = d->keep + d->keep_start[c+1];
+  for (x = first; x < end && *x < j; x++) {}
+  k = x < end ? *x : p->data.or.n;
+  
+  if (j == (x > first ? x[-1] + 1 : 0)) {
+    at = 2 * (d->keep_start[c] + c + (int)(x - first));
+    mpc_dispatch_fail(i, d->merged + d->runs[at], d->runs[at+1], c, e);
+    return k;
+  }
+  
+  for (; j < k; j++) {
+    mpc_dispatch_fail(i, d->labels + d->plan[j], d->plan_num[j], c, e);
+  }
+  
+  return k;
+}
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Starts running a parser. Those without children
+** finish straight away, while the rest push a frame
+** for themselves and ask for their first child to be
+** run by returning `MPC_PARSE_CALL`. Labels directly
+** around a character parser, which is how nearly all
+** of them are built, finish without a frame as well.
+** Their errors are suppressed in any case, so a set
+** never has to rerun its alternatives there.
+*/
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static int mpc_parse_enter(mpc_input_t *i, mpc_parser_t *p, mpc_run_result_t *r, mpc_err_rec_t **e, mpc_parser_t **c) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int j;
   
   switch (p->type) {
       
@@ -1027,39 +3637,189 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
     case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
     case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
     
+    /*
+    ** A miss on a folded set only reruns the original
+    ** alternatives when the errors they report could
+    ** still be kept, otherwise they are all dropped.
+    */
+    
+    case MPC_TYPE_SET:
+      
+      if (mpc_input_set(i, p->data.set.x, (char**)&r->output)) { MPC_SUCCESS(r->output); }
+      if (p->data.set.n == 0 || i->suppress || i->state.pos < i->err_pos) { MPC_FAILURE(NULL); }
+      
+      for (j = 0; j < p->data.set.n; j++) {
+        if (mpc_parse_run(i, p->data.set.xs[j], r, e)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          *e = mpc_err_merge(i, *e, r->error);
+        }
+      }
+      
+      MPC_FAILURE(NULL);
+    
+    /*
+    ** Tries miss just as folded sets do. In predictive
+    ** mode a failed string is not rewound, so the `or`
+    ** the trie was folded from is run as it was.
+    */
+    
+    case MPC_TYPE_TRIE:
+      
+      if (i->backtrack > 0) {
+        if (mpc_input_trie(i, p->data.trie.t, (char**)&r->output)) { MPC_SUCCESS(r->output); }
+        if (i->suppress || i->state.pos < i->err_pos) { MPC_FAILURE(NULL); }
+      }
+      
+      for (j = 0; j < p->data.trie.n; j++) {
+        if (mpc_parse_run(i, p->data.trie.xs[j], r, e)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          *e = mpc_err_merge(i, *e, r->error);
+        }
+      }
+      
+      MPC_FAILURE(NULL);
+    
+    /*
+    ** Compiled regexes only scan string inputs, and
+    ** parse with the original tree when predictive
+    ** mode means failures are not rewound.
+    */
+    
+    case MPC_TYPE_DFA:
+      
+      if (i->type != MPC_INPUT_STRING || i->backtrack < 1 || p->data.dfa.d->broken) {
+        return mpc_parse_run(i, p->data.dfa.x, r, e);
+      }
+      
+      return mpc_dfa_run(i, &p->data.dfa, r, e);
+    
     /* Other parsers */
     
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
     case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
     case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(i->spans ? NULL : p->data.lift.lf());
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
     
     /* Application Parsers */
     
+    case MPC_TYPE_APPLY:      *c = p->data.apply.x; break;
+    case MPC_TYPE_APPLY_TO:   *c = p->data.apply_to.x; break;
+    case MPC_TYPE_CHECK:      *c = p->data.check.x; break;
+    case MPC_TYPE_CHECK_WITH: *c = p->data.check_with.x; break;
+    
+    case MPC_TYPE_EXPECT:
+      j = mpc_parse_primitive(i, p->data.expect.x, (char**)&r->output);
+      if (j == 1) { MPC_SUCCESS(r->output); }
+      if (j == 0) { MPC_FAILURE(mpc_err_new(i, p->data.expect.m, p->data.expect.h)); }
+      mpc_input_suppress_enable(i);
+      *c = p->data.expect.x;
+      break;
+    
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_disable(i);
+      *c = p->data.predict.x;
+      break;
+    
+    case MPC_TYPE_MEMO:
+      *c = p->data.memo.x;
+      return mpc_memo_enter(i, p, r, e);
+    
+    /* Optional Parsers */
+    
+    case MPC_TYPE_NOT:
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      *c = p->data.not.x;
+      break;
+    
+    case MPC_TYPE_MAYBE: *c = p->data.not.x; break;
+    
+    /* Repeat Parsers */
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if ((p->span & MPC_SPAN_TEXT) && i->type == MPC_INPUT_STRING && i->backtrack >= 1) {
+        return mpc_parse_span(i, p, r, e);
+      }
+      *c = p->data.repeat.x;
+      break;
+    
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      j = mpc_dispatch_next(i, p, 0, e);
+      if (j == p->data.or.n) { MPC_FAILURE(NULL); }
+      mpc_parse_frame_push(i, p);
+      i->frames[i->frames_num-1].j = j;
+      *c = p->data.or.xs[j];
+      return MPC_PARSE_CALL;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      if ((p->span & MPC_SPAN_TEXT) && i->type == MPC_INPUT_STRING && i->backtrack >= 1) {
+        return mpc_parse_span(i, p, r, e);
+      }
+      mpc_input_mark(i);
+      *c = p->data.and.xs[0];
+      break;
+    
+    /* End */
+    
+    default:
+      
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+  
+  mpc_parse_frame_push(i, p);
+  return MPC_PARSE_CALL;
+  
+}
+
+/*
+** Takes the result of the child just run by the
+** parser on top of the frame stack. Its frame is
+** popped, and pushed back by repeats and sequences
+** that go on to run another child. Outputs kept for
+** a fold sit on the value stack from the frame's
+** base up.
+*/
+
+static int mpc_parse_leave(mpc_input_t *i, int x, mpc_run_result_t *r, mpc_err_rec_t **e, mpc_parser_t **c) {
+  
+  mpc_parse_frame_t *f = &i->frames[--i->frames_num];
+  mpc_parser_t *p = f->p;
+  int j = f->base, k;
+  
+  switch (p->type) {
+    
+    /* Application Parsers */
+    
     case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
+      if (x) {
         MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
       } else {
         MPC_FAILURE(r->output);
       }
     
     case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+      if (x) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
         MPC_FAILURE(r->error);
       }
 
     case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e)) {
+      if (x) {
         if (p->data.check.f(&r->output)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1070,7 +3830,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e)) {
+      if (x) {
         if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1081,170 +3841,124 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
+      mpc_input_suppress_disable(i);
+      if (x) {
         MPC_SUCCESS(r->output);
       } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+        MPC_FAILURE(mpc_err_new(i, p->data.expect.m, p->data.expect.h));
       }
     
     case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+      mpc_input_backtrack_enable(i);
+      return x;
+    
+    case MPC_TYPE_MEMO:
+      return mpc_memo_leave(i, f, x, r, e);
     
     /* Optional Parsers */
     
     /* TODO: Update Not Error Message */
     
     case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (x) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
         mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
+        MPC_FAILURE(mpc_err_new(i, "opposite", mpc_err_label_hash_text("opposite")));
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(i->spans ? NULL : p->data.not.lf());
       }
     
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (x) {
         MPC_SUCCESS(r->output);
       } else {
         *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(i->spans ? NULL : p->data.not.lf());
       }
     
     /* Repeat Parsers */
     
     case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
       
-      results = results_stk;
+      if (x) {
+        mpc_parse_value_push(i, r->output);
+        i->frames_num++;
+        *c = p->data.repeat.x;
+        return MPC_PARSE_CALL;
+      }
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+      if (p->type == MPC_TYPE_MANY1 && i->values_num == j) {
+        MPC_FAILURE(mpc_err_many1(i, r->error));
       }
       
-      *e = mpc_err_merge(i, *e, results[j].error);
+      *e = mpc_err_merge(i, *e, r->error);
       MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        mpc_parse_fold(i, p->data.repeat.f, i->values_num - j, i->values + j);
+        i->values_num = j);
     
-    case MPC_TYPE_MANY1:
-      
-      results = results_stk;
+    case MPC_TYPE_COUNT:
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+      if (x) {
+        mpc_parse_value_push(i, r->output);
+        if (i->values_num - j != p->data.repeat.n) {
+          i->frames_num++;
+          *c = p->data.repeat.x;
+          return MPC_PARSE_CALL;
         }
-      }
-      
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
         MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
-    
-    case MPC_TYPE_COUNT:
-      
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
+          mpc_parse_fold(i, p->data.repeat.f, i->values_num - j, i->values + j);
+          i->values_num = j);
       }
       
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
+      for (k = j; k < i->values_num; k++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, i->values[k]);
       }
+      i->values_num = j;
+      MPC_FAILURE(mpc_err_count(i, r->error, p->data.repeat.n));
       
     /* Combinatory Parsers */
     
     case MPC_TYPE_OR:
       
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      if (x) { MPC_SUCCESS(r->output); }
       
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
+      /* Skipped alternatives may be run over this frame's slot */
+      *e = mpc_err_merge(i, *e, r->error);
+      k = mpc_dispatch_next(i, p, f->j + 1, e);
+      if (k < p->data.or.n) {
+        mpc_parse_frame_push(i, p);
+        i->frames[i->frames_num-1].j = k;
+        *c = p->data.or.xs[k];
+        return MPC_PARSE_CALL;
       }
       
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      MPC_FAILURE(NULL);
     
     case MPC_TYPE_AND:
       
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (x) {
+        mpc_parse_value_push(i, r->output);
+        if (++f->j < p->data.and.n) {
+          i->frames_num++;
+          *c = p->data.and.xs[f->j];
+          return MPC_PARSE_CALL;
         }
+        mpc_input_unmark(i);
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.and.f, f->j, i->values + j);
+          i->values_num = j);
       }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      
+      mpc_input_rewind(i);
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, p->data.and.dxs[k], i->values[j + k]);
+      }
+      i->values_num = j;
+      MPC_FAILURE(r->error);
     
     /* End */
     
@@ -1257,20 +3971,49 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
   
 }
 
+/*
+** Parsers are run from an explicit stack of frames
+** kept on the input, rather than by recursion, so
+** the depth of nesting in the input is only limited
+** by the heap. Runs started inside another, such as
+** the alternatives of a set, share the same stacks
+** and finish once they are back down to where they
+** started.
+*/
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_run_result_t *r, mpc_err_rec_t **e) {
+  
+  int base = i->frames_num;
+  int x = MPC_PARSE_CALL;
+  
+  do {
+    x = x == MPC_PARSE_CALL
+      ? mpc_parse_enter(i, p, r, e, &p)
+      : mpc_parse_leave(i, x, r, e, &p);
+  } while (x == MPC_PARSE_CALL || i->frames_num > base);
+  
+  return x;
+  
+}
+
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_run_result_t q;
+  mpc_err_rec_t *e;
+  mpc_err_labels_reset(i);
+  e = mpc_err_rec_new(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e);
+  x = mpc_parse_run(i, p, &q, &e);
+  mpc_memo_clear(i);
   if (x) {
     mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+    r->output = mpc_export(i, q.output);
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    r->error = mpc_err_export(i, mpc_err_merge(i, e, q.error));
   }
   return x;
 }
@@ -1291,6 +4034,49 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_view(NULL, filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(void) {
+  mpc_parse_ctx_t *c = malloc(sizeof(mpc_parse_ctx_t));
+  c->spare = NULL;
+  c->mem_hits = 0;
+  c->mem_fallbacks = 0;
+  return c;
+}
+
+void mpc_parse_ctx_reset(mpc_parse_ctx_t *c) {
+  c->mem_hits = 0;
+  c->mem_fallbacks = 0;
+  if (c->spare) {
+    mpc_input_free(c->spare);
+    c->spare = NULL;
+  }
+}
+
+void mpc_parse_ctx_mem_stats(mpc_parse_ctx_t *c, unsigned long *hits, unsigned long *fallbacks) {
+  *hits = c->mem_hits;
+  *fallbacks = c->mem_fallbacks;
+}
+
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c) {
+  mpc_parse_ctx_reset(c);
+  free(c);
+}
+
+int mpc_parse_ctx_view(mpc_parse_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_view(c, filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1307,6 +4093,14 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+int mpc_parse_mmap(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_mmap(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
@@ -1318,7 +4112,7 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  res = mpc_parse_mmap(filename, f, p, r);
   fclose(f);
   return res;
 }
@@ -1327,15 +4121,47 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 ** Building a Parser
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static int mpc_dfa_init(mpc_parser_t *p, mpc_parser_t *x);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  mpc_dispatch_delete(p->data.or.d);
+  
+}
+
+static void mpc_undefine_set(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.set.n; i++) {
+    mpc_undefine_unretained(p->data.set.xs[i], 0);
+  }
+  free(p->data.set.xs);
+  free(p->data.set.x);
+  
+}
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+static void mpc_undefine_trie(mpc_parser_t *p) {
   
   int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  for (i = 0; i < p->data.trie.n; i++) {
+    mpc_undefine_unretained(p->data.trie.xs[i], 0);
   }
-  free(p->data.or.xs);
+  free(p->data.trie.xs);
+  mpc_trie_delete(p->data.trie.t);
+  
+}
+
+static void mpc_undefine_dfa(mpc_parser_t *p) {
+  
+  if (p->data.dfa.d->shell) { mpc_dfa_shell_delete(p->data.dfa.y); }
+  mpc_dfa_delete(p->data.dfa.d);
+  mpc_undefine_unretained(p->data.dfa.x, 0);
   
 }
 
@@ -1358,15 +4184,17 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     
     case MPC_TYPE_FAIL: free(p->data.fail.m); break;
     
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
     case MPC_TYPE_STRING:
       free(p->data.string.x); 
       break;
     
+    case MPC_TYPE_SET:  mpc_undefine_set(p);  break;
+    case MPC_TYPE_TRIE: mpc_undefine_trie(p); break;
+    
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1386,6 +4214,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    case MPC_TYPE_DFA: mpc_undefine_dfa(p); break;
     
     case MPC_TYPE_CHECK:
       mpc_undefine_unretained(p->data.check.x, 0);
@@ -1444,7 +4273,7 @@ mpc_parser_t *mpc_new(const char *name) {
 
 mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   int i = 0;
-  mpc_parser_t *p;
+  mpc_parser_t *p, *x;
   
   if (a->retained) { return a; }
   
@@ -1452,6 +4281,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->span = a->span;
   
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -1465,16 +4295,32 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.fail.m, a->data.fail.m);
     break;
     
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
     case MPC_TYPE_STRING:
       p->data.string.x = malloc(strlen(a->data.string.x)+1);
       strcpy(p->data.string.x, a->data.string.x);
       break;
     
+    case MPC_TYPE_SET:
+      p->data.set.x = malloc(MPC_SET_BYTES);
+      memcpy(p->data.set.x, a->data.set.x, MPC_SET_BYTES);
+      p->data.set.xs = a->data.set.n > 0 ? malloc(a->data.set.n * sizeof(mpc_parser_t*)) : NULL;
+      for (i = 0; i < a->data.set.n; i++) {
+        p->data.set.xs[i] = mpc_copy(a->data.set.xs[i]);
+      }
+      break;
+    
+    case MPC_TYPE_TRIE:
+      p->data.trie.xs = malloc(a->data.trie.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.trie.n; i++) {
+        p->data.trie.xs[i] = mpc_copy(a->data.trie.xs[i]);
+      }
+      p->data.trie.t = mpc_trie_new(p->data.trie.n, p->data.trie.xs);
+      break;
+    
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1485,6 +4331,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       p->data.expect.x = mpc_copy(a->data.expect.x);
       p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
       strcpy(p->data.expect.m, a->data.expect.m);
+      p->data.expect.h = a->data.expect.h;
       break;
       
     case MPC_TYPE_MANY:
@@ -1498,6 +4345,8 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      p->data.or.d = NULL;
+      if (a->data.or.d) { mpc_dispatch_build(p); }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1520,6 +4369,16 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
+    
+    case MPC_TYPE_DFA:
+      x = mpc_copy(a->data.dfa.x);
+      if (!mpc_dfa_init(p, x)) {
+        p->type = x->type;
+        p->data = x->data;
+        free(x->name);
+        free(x);
+      }
+      break;
 
     default: break;
   }
@@ -1529,8 +4388,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  p->generation++;
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->span = 0;
   return p;
 }
 
@@ -1539,14 +4400,18 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
+    p->span = a->span;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
     p->data = a2->data;
+    p->span = a2->span;
     free(a2);
   }
   
   free(a);
+  p->generation++;
+  mpc_dispatch_refresh(p, 1);
   return p;  
 }
 
@@ -1628,6 +4493,7 @@ mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_LIFT;
   p->data.lift.lf = lf;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1650,6 +4516,8 @@ mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
   p->data.expect.x = a;
   p->data.expect.m = malloc(strlen(expected) + 1);
   strcpy(p->data.expect.m, expected);
+  p->data.expect.h = mpc_err_label_hash_text(expected);
+  mpc_span_update(p);
   return p;
 }
 
@@ -1688,6 +4556,8 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   buffer = realloc(buffer, strlen(buffer) + 1);
   p->data.expect.x = a;
   p->data.expect.m = buffer;
+  p->data.expect.h = mpc_err_label_hash_text(buffer);
+  mpc_span_update(p);
   return p;
 }
 
@@ -1698,6 +4568,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
 mpc_parser_t *mpc_any(void) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ANY;
+  mpc_span_update(p);
   return mpc_expect(p, "any character");
 }
 
@@ -1705,6 +4576,7 @@ mpc_parser_t *mpc_char(char c) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SINGLE;
   p->data.single.x = c;
+  mpc_span_update(p);
   return mpc_expectf(p, "'%c'", c);
 }
 
@@ -1713,30 +4585,77 @@ mpc_parser_t *mpc_range(char s, char e) {
   p->type = MPC_TYPE_RANGE;
   p->data.range.x = s;
   p->data.range.y = e;
+  mpc_span_update(p);
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
-mpc_parser_t *mpc_oneof(const char *s) {
+/*
+** The terminating null of the class string has
+** always been treated as part of the class, so
+** it is a member of every `oneof` set and of no
+** `noneof` set.
+*/
+
+static mpc_parser_t *mpc_set_new(const char *s, int comp) {
+  
   mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+  unsigned char u;
+  
+  p->type = MPC_TYPE_SET;
+  p->data.set.x = calloc(1, MPC_SET_BYTES);
+  p->data.set.n = 0;
+  p->data.set.xs = NULL;
+  
+  p->data.set.x[0] = 1;
+  while (*s) {
+    u = (unsigned char)*s++;
+    p->data.set.x[u >> 3] |= 1 << (u & 7);
+  }
+  
+  if (comp) {
+    for (u = 0; u < MPC_SET_BYTES; u++) {
+      p->data.set.x[u] = ~p->data.set.x[u];
+    }
+  }
+  
+  mpc_span_update(p);
+  return p;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
+/*
+** Adds the characters matched by a single character,
+** range or set parser to a set.
+*/
 
+static void mpc_set_add(unsigned char *x, mpc_parser_t *p) {
+  
+  int c;
+  char y;
+  
+  for (c = 0; c < 256; c++) {
+    y = (char)c;
+    if ((p->type == MPC_TYPE_SINGLE && y == p->data.single.x)
+    ||  (p->type == MPC_TYPE_RANGE && y >= p->data.range.x && y <= p->data.range.y)
+    ||  (p->type == MPC_TYPE_SET && ((p->data.set.x[c >> 3] >> (c & 7)) & 1))) {
+      x[c >> 3] |= 1 << (c & 7);
+    }
+  }
+  
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  return mpc_expectf(mpc_set_new(s, 0), "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  return mpc_expectf(mpc_set_new(s, 1), "none of '%s'", s);
 }
 
 mpc_parser_t *mpc_satisfy(int(*f)(char)) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_SATISFY;
   p->data.satisfy.f = f;
+  mpc_span_update(p);
   return mpc_expectf(p, "character satisfying function %p", f);
 }
 
@@ -1745,6 +4664,7 @@ mpc_parser_t *mpc_string(const char *s) {
   p->type = MPC_TYPE_STRING;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_span_update(p);
   return mpc_expectf(p, "\"%s\"", s);
 }
 
@@ -1829,12 +4749,35 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+/*
+** Memoizes a parser in place, so rules already in
+** use, such as those from `mpca_lang`, can be
+** switched over. Its definition moves into a new
+** parser run underneath. Outputs are copied with
+** `cp`, which must leave its argument alone, and
+** the copies kept are freed with `da`.
+*/
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *a, mpc_apply_t cp, mpc_dtor_t da) {
+  mpc_parser_t *x = mpc_undefined();
+  x->type = a->type;
+  x->data = a->data;
+  x->span = a->span;
+  a->type = MPC_TYPE_MEMO;
+  a->data.memo.x = x;
+  a->data.memo.cp = cp;
+  a->data.memo.dx = da;
+  mpc_span_update(a);
+  return a;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
   p->data.not.x = a;
   p->data.not.dx = da;
   p->data.not.lf = lf;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1847,6 +4790,7 @@ mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
   p->type = MPC_TYPE_MAYBE;
   p->data.not.x = a;
   p->data.not.lf = lf;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1859,6 +4803,7 @@ mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1867,6 +4812,7 @@ mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
   p->type = MPC_TYPE_MANY1;
   p->data.repeat.x = a;
   p->data.repeat.f = f;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1877,6 +4823,7 @@ mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
   p->data.repeat.f = f;
   p->data.repeat.x = a;
   p->data.repeat.dx = da;
+  mpc_span_update(p);
   return p;
 }
 
@@ -1897,6 +4844,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   }
   va_end(va);
   
+  mpc_span_update(p);
   return p;
 }
 
@@ -1922,6 +4870,7 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
   }  
   va_end(va);
   
+  mpc_span_update(p);
   return p;
 }
 
@@ -2200,32 +5149,57 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
+/*
+** The expanded range is only kept for the error
+** label; matching is done against the set built
+** from it, so it is grown geometrically rather
+** than reallocated for every character.
+*/
+
+typedef struct {
+  char *x;
+  size_t n;
+  size_t slots;
+} mpc_re_range_t;
+
+static void mpc_re_range_push(mpc_re_range_t *r, char c) {
+  if (c == '\0') { return; }
+  if (r->n + 1 >= r->slots) {
+    r->slots *= 2;
+    r->x = realloc(r->x, r->slots);
+  }
+  r->x[r->n++] = c;
+  r->x[r->n] = '\0';
+}
+
 static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   mpc_parser_t *out;
-  size_t i, j;
+  mpc_re_range_t range;
+  size_t i, j, l;
   size_t start, end;
   const char *tmp = NULL;
   const char *s = x;
   int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
   
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
   if (s[0] == '^' && 
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
   
-  for (i = comp; i < strlen(s); i++){
+  range.n = 0;
+  range.slots = 64;
+  range.x = calloc(1, range.slots);
+  l = strlen(s);
+  
+  for (i = comp; i < l; i++){
     
     /* Regex Range Escape */
     if (s[i] == '\\') {
       tmp = mpc_re_range_escape_char(s[i+1]);
       if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
+        while (*tmp) { mpc_re_range_push(&range, *tmp++); }
       } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+        mpc_re_range_push(&range, s[i+1]);
       }
       i++;
     }
@@ -2233,36 +5207,451 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
     /* Regex Range...Range */
     else if (s[i] == '-') {
       if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
+        mpc_re_range_push(&range, '-');
       } else {
         start = s[i-1]+1;
         end = s[i+1]-1;
         for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
+          mpc_re_range_push(&range, (char)j);
         }        
       }
     }
     
     /* Regex Range Normal */
     else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+      mpc_re_range_push(&range, s[i]);
     }
   
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  out = comp == 1 ? mpc_noneof(range.x) : mpc_oneof(range.x);
   
   free(x);
-  free(range);
+  free(range.x);
   
   return out;
 }
 
+/*
+** A regex is only compiled when at every `or`,
+** `maybe` and repeat the next character alone
+** decides which way the tree goes. Anything else,
+** such as anchors inside the regex, leaves it as
+** a tree.
+*/
+
+static mpc_parser_t *mpc_dfa_leaf(mpc_parser_t *p) {
+  
+  while (!p->retained && p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->retained) { return NULL; }
+  
+  if (p->type == MPC_TYPE_ANY
+  ||  p->type == MPC_TYPE_SINGLE
+  ||  p->type == MPC_TYPE_RANGE
+  ||  p->type == MPC_TYPE_SET) { return p; }
+  
+  return NULL;
+}
+
+static void mpc_dfa_leaf_set(unsigned char *x, mpc_parser_t *p) {
+  if (p->type == MPC_TYPE_ANY) { memset(x, 0xFF, MPC_SET_BYTES); }
+  else { mpc_set_add(x, p); }
+}
+
+static int mpc_dfa_and(mpc_parser_t *p) {
+  int j;
+  if (p->data.and.f != mpcf_strfold || p->data.and.n == 0) { return 0; }
+  for (j = 0; j < p->data.and.n-1; j++) {
+    if (p->data.and.dxs[j] != free) { return 0; }
+  }
+  return 1;
+}
+
+/*
+** Adds the characters a parser can start with to
+** `first`, returning whether it can match nothing,
+** or -1 if it cannot be compiled.
+*/
+
+static int mpc_dfa_first(mpc_parser_t *p, unsigned char *first) {
+  
+  int j, r, n = 1;
+  unsigned char rest[MPC_SET_BYTES];
+  mpc_parser_t *x = mpc_dfa_leaf(p);
+  
+  if (x) { mpc_dfa_leaf_set(first, x); return 0; }
+  if (p->retained) { return -1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str ? 1 : -1;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      return mpc_dfa_first(p->data.not.x, first) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      if (p->type == MPC_TYPE_COUNT && (p->data.repeat.n < 1 || p->data.repeat.dx != free)) { return -1; }
+      r = mpc_dfa_first(p->data.repeat.x, first);
+      return p->type == MPC_TYPE_MANY && r >= 0 ? 1 : r;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return -1; }
+      for (n = 0, j = 0; j < p->data.or.n; j++) {
+        r = mpc_dfa_first(p->data.or.xs[j], first);
+        if (r < 0) { return -1; }
+        n = n || r;
+      }
+      return n;
+    
+    case MPC_TYPE_AND:
+      if (!mpc_dfa_and(p)) { return -1; }
+      for (j = 0; j < p->data.and.n; j++) {
+        r = mpc_dfa_first(p->data.and.xs[j], n ? first : rest);
+        if (r < 0) { return -1; }
+        n = n && r;
+      }
+      return n;
+    
+    default: return -1;
+  }
+  
+}
+
+static int mpc_dfa_disjoint(const unsigned char *x, const unsigned char *y) {
+  int j;
+  for (j = 0; j < MPC_SET_BYTES; j++) { if (x[j] & y[j]) { return 0; } }
+  return 1;
+}
+
+/*
+** Checks that given the characters which can follow
+** a parser, each choice within it is decided by the
+** next character alone. A `count` that fails part
+** way does not rewind, so it must be inside an `and`
+** which does before any choice sees the failure.
+*/
+
+static int mpc_dfa_check(mpc_parser_t *p, const unsigned char *follow, int and) {
+  
+  int j, r;
+  unsigned char first[MPC_SET_BYTES], all[MPC_SET_BYTES], next[MPC_SET_BYTES];
+  
+  if (mpc_dfa_leaf(p) || p->type == MPC_TYPE_LIFT) { return 1; }
+  
+  memset(first, 0, MPC_SET_BYTES);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_MAYBE:
+      mpc_dfa_first(p->data.not.x, first);
+      return mpc_dfa_disjoint(first, follow) && mpc_dfa_check(p->data.not.x, follow, 0);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      r = mpc_dfa_first(p->data.repeat.x, first);
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n == 1) {
+        return mpc_dfa_check(p->data.repeat.x, follow, and);
+      }
+      if (p->type == MPC_TYPE_COUNT && !and) { return 0; }
+      if (r || (p->type != MPC_TYPE_COUNT && !mpc_dfa_disjoint(first, follow))) { return 0; }
+      for (j = 0; j < MPC_SET_BYTES; j++) { next[j] = first[j] | follow[j]; }
+      return mpc_dfa_check(p->data.repeat.x, next, p->type == MPC_TYPE_COUNT);
+    
+    case MPC_TYPE_OR:
+      memset(all, 0, MPC_SET_BYTES);
+      for (j = 0; j < p->data.or.n; j++) {
+        memset(first, 0, MPC_SET_BYTES);
+        r = mpc_dfa_first(p->data.or.xs[j], first);
+        if (!mpc_dfa_disjoint(first, all)) { return 0; }
+        if (r && (j < p->data.or.n-1 || !mpc_dfa_disjoint(all, follow) || !mpc_dfa_disjoint(first, follow))) { return 0; }
+        if (!mpc_dfa_check(p->data.or.xs[j], follow, 0)) { return 0; }
+        for (r = 0; r < MPC_SET_BYTES; r++) { all[r] |= first[r]; }
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      memcpy(next, follow, MPC_SET_BYTES);
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        if (!mpc_dfa_check(p->data.and.xs[j], next, 1)) { return 0; }
+        memset(first, 0, MPC_SET_BYTES);
+        if (!mpc_dfa_first(p->data.and.xs[j], first)) { memset(next, 0, MPC_SET_BYTES); }
+        for (r = 0; r < MPC_SET_BYTES; r++) { next[r] |= first[r]; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_nfa_state(mpc_dfa_t *d, int type, int out, int out1) {
+  
+  mpc_nfa_state_t *s;
+  
+  if (d->nfa_num == MPC_NFA_MAX) { return -1; }
+  
+  if (d->nfa_num == d->nfa_slots) {
+    d->nfa_slots = d->nfa_slots ? d->nfa_slots * 2 : MPC_DFA_STATES_MIN * 4;
+    d->nfa = realloc(d->nfa, sizeof(mpc_nfa_state_t) * d->nfa_slots);
+  }
+  
+  s = &d->nfa[d->nfa_num];
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  memset(s->set, 0, MPC_SET_BYTES);
+  return d->nfa_num++;
+}
+
+/*
+** Builds the NFA for a parser backwards from the
+** state that follows it, so every piece only needs
+** the one state it leads into. Repeats get a copy
+** of their body per count, and `many1` a separate
+** copy for the first time round.
+*/
+
+static int mpc_dfa_build(mpc_dfa_t *d, mpc_parser_t *p, int next) {
+  
+  int j, k, s;
+  mpc_parser_t *x = mpc_dfa_leaf(p);
+  
+  if (next < 0) { return -1; }
+  
+  if (x) {
+    s = mpc_nfa_state(d, MPC_NFA_SET, next, -1);
+    if (s >= 0) { mpc_dfa_leaf_set(d->nfa[s].set, x); }
+    return s;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_MAYBE:
+      s = mpc_dfa_build(d, p->data.not.x, next);
+      return s < 0 ? -1 : mpc_nfa_state(d, MPC_NFA_SPLIT, s, next);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      s = mpc_nfa_state(d, MPC_NFA_SPLIT, -1, next);
+      if (s < 0) { return -1; }
+      j = mpc_dfa_build(d, p->data.repeat.x, s);
+      if (j < 0) { return -1; }
+      d->nfa[s].out = j;
+      return p->type == MPC_TYPE_MANY ? s : mpc_dfa_build(d, p->data.repeat.x, s);
+    
+    case MPC_TYPE_COUNT:
+      for (j = 0; j < p->data.repeat.n; j++) {
+        next = mpc_dfa_build(d, p->data.repeat.x, next);
+      }
+      return next;
+    
+    case MPC_TYPE_OR:
+      s = mpc_dfa_build(d, p->data.or.xs[p->data.or.n-1], next);
+      for (j = p->data.or.n-2; j >= 0 && s >= 0; j--) {
+        k = mpc_dfa_build(d, p->data.or.xs[j], next);
+        s = k < 0 ? -1 : mpc_nfa_state(d, MPC_NFA_SPLIT, k, s);
+      }
+      return s;
+    
+    case MPC_TYPE_AND:
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        next = mpc_dfa_build(d, p->data.and.xs[j], next);
+      }
+      return next;
+    
+    default: return next;
+  }
+  
+}
+
+/*
+** An anchor in the regex builds an `and` of the
+** anchor and an empty string.
+*/
+
+static int mpc_dfa_anchor(mpc_parser_t *p) {
+  
+  mpc_parser_t *x;
+  
+  if (p->retained || p->type != MPC_TYPE_AND
+  ||  p->data.and.n != 2 || p->data.and.f != mpcf_snd) { return 0; }
+  
+  x = p->data.and.xs[0];
+  while (!x->retained && x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  p = p->data.and.xs[1];
+  
+  return !x->retained && x->type == MPC_TYPE_ANCHOR
+    && !p->retained && p->type == MPC_TYPE_LIFT && p->data.lift.lf == mpcf_ctor_str;
+}
+
+/*
+** Records the errors of every state the scan can get
+** stuck in, for both ways of having got there. Each
+** pair of a state and whether the scan accepted on
+** the way is reached first by a breadth first search
+** from the start, which gives the shortest text to
+** run the tree over.
+*/
+
+static void mpc_dfa_errors(mpc_pdata_dfa_t *p) {
+  
+  mpc_dfa_t *d = p->d;
+  int j, k, c, q, u, v, len, top = 0, end = 0, n = d->states_num * 2;
+  int *from = malloc(sizeof(int) * n);
+  int *depth = malloc(sizeof(int) * n);
+  int *queue = malloc(sizeof(int) * n);
+  unsigned char *by = malloc(n);
+  char *text = malloc(n + 1);
+  long last;
+  
+  for (j = 0; j < n; j++) { from[j] = -2; }
+  
+  u = d->states[0].accept;
+  from[u] = -1;
+  depth[u] = 0;
+  queue[end++] = u;
+  
+  while (top < end) {
+    u = queue[top++];
+    for (c = 0; c < 256; c++) {
+      q = d->trans[(u / 2) * 256 + c];
+      if (q == MPC_DFA_DEAD) { continue; }
+      v = q * 2 + ((u & 1) | d->states[q].accept);
+      if (from[v] != -2) { continue; }
+      from[v] = u;
+      depth[v] = depth[u] + 1;
+      by[v] = (unsigned char)c;
+      queue[end++] = v;
+    }
+  }
+  
+  for (j = 0; j < end && !d->broken; j++) {
+    
+    v = queue[j];
+    if (!d->states[v / 2].leaves) { continue; }
+    
+    len = depth[v];
+    for (k = len, u = v; k > 0; k--, u = from[u]) { text[k-1] = (char)by[u]; }
+    
+    last = d->states[0].accept ? 0 : -1;
+    for (k = 0, q = 0; k < len; k++) {
+      q = d->trans[q * 256 + (unsigned char)text[k]];
+      if (d->states[q].accept) { last = k + 1; }
+    }
+    
+    d->states[v / 2].errors[v & 1] = mpc_dfa_error_new(p, text, len, last);
+  }
+  
+  /* A tree that does not agree is always run to make errors */
+  
+  if (d->broken) {
+    for (j = 0; j < d->states_num; j++) {
+      mpc_dfa_error_delete(d->states[j].errors[0]);
+      mpc_dfa_error_delete(d->states[j].errors[1]);
+      d->states[j].errors[0] = NULL;
+      d->states[j].errors[1] = NULL;
+    }
+  }
+  
+  free(from);
+  free(depth);
+  free(queue);
+  free(by);
+  free(text);
+}
+
+/*
+** Compiles `x` into `p`, splitting anchors at either
+** end off the body. A middle of several parts runs
+** as an `and` which borrows them from `x`.
+*/
+
+static int mpc_dfa_init(mpc_parser_t *p, mpc_parser_t *x) {
+  
+  int j, c, start, lo = 0, hi = 0, shell = 0;
+  mpc_parser_t *a = NULL, *y = x, *z = NULL;
+  unsigned char first[MPC_SET_BYTES], none[MPC_SET_BYTES];
+  mpc_dfa_t *d;
+  
+  if (!x->retained && x->type == MPC_TYPE_AND && x->data.and.n > 1 && mpc_dfa_and(x)) {
+    hi = x->data.and.n;
+    if (mpc_dfa_anchor(x->data.and.xs[0])) { a = x->data.and.xs[lo++]; }
+    if (hi > lo && mpc_dfa_anchor(x->data.and.xs[hi-1])) { z = x->data.and.xs[--hi]; }
+    if (hi == lo) { return 0; }
+  }
+  
+  if ((a || z) && hi - lo == 1) { y = x->data.and.xs[lo]; }
+  
+  if ((a || z) && hi - lo > 1) {
+    y = mpc_undefined();
+    y->type = MPC_TYPE_AND;
+    y->data.and.n = hi - lo;
+    y->data.and.f = mpcf_strfold;
+    y->data.and.xs = malloc(sizeof(mpc_parser_t*) * (hi - lo));
+    y->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (hi - lo - 1));
+    for (j = lo; j < hi; j++) { y->data.and.xs[j - lo] = x->data.and.xs[j]; }
+    for (j = 0; j < hi - lo - 1; j++) { y->data.and.dxs[j] = free; }
+    shell = 1;
+  }
+  
+  memset(first, 0, MPC_SET_BYTES);
+  memset(none, 0, MPC_SET_BYTES);
+  
+  if (mpc_dfa_leaf(y) || mpc_dfa_first(y, first) < 0 || !mpc_dfa_check(y, none, y != x)) {
+    if (shell) { mpc_dfa_shell_delete(y); }
+    return 0;
+  }
+  
+  d = calloc(1, sizeof(mpc_dfa_t));
+  d->shell = shell;
+  
+  start = mpc_dfa_build(d, y, mpc_nfa_state(d, MPC_NFA_MATCH, -1, -1));
+  if (start < 0) {
+    if (shell) { mpc_dfa_shell_delete(y); }
+    mpc_dfa_delete(d);
+    return 0;
+  }
+  
+  d->stamps = calloc(d->nfa_num, sizeof(unsigned int));
+  d->work = malloc(sizeof(int) * d->nfa_num);
+  d->stack = malloc(sizeof(int) * d->nfa_num);
+  d->start = malloc(sizeof(int) * d->nfa_num);
+  d->start_num = mpc_dfa_closure(d, &start, 1, d->start);
+  mpc_dfa_add(d, d->start, d->start_num);
+  
+  for (j = 0; j < d->states_num; j++) {
+    for (c = 0; c < 256; c++) {
+      if (mpc_dfa_next(d, j, (unsigned char)c) == -1) {
+        if (shell) { mpc_dfa_shell_delete(y); }
+        mpc_dfa_delete(d);
+        return 0;
+      }
+    }
+  }
+  
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  p->data.dfa.x = x;
+  p->data.dfa.a = a;
+  p->data.dfa.y = y;
+  p->data.dfa.z = z;
+  mpc_span_update(p);
+  
+  mpc_dfa_errors(&p->data.dfa);
+  return 1;
+}
+
+static mpc_parser_t *mpc_dfa_new(mpc_parser_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  if (!mpc_dfa_init(p, x)) { free(p); return x; }
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2326,7 +5715,7 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  return mpc_dfa_new(r.output);
   
 }
 
@@ -2587,6 +5976,29 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
 ** Printing
 */
 
+static void mpc_print_set(const unsigned char *x) {
+  
+  char members[256];
+  char *s;
+  int c, n = 0, comp;
+  
+  for (c = 1; c < 256; c++) { n += (x[c >> 3] >> (c & 7)) & 1; }
+  comp = n > 127;
+  
+  n = 0;
+  for (c = 1; c < 256; c++) {
+    if (((x[c >> 3] >> (c & 7)) & 1) != comp) { members[n++] = (char)c; }
+  }
+  members[n] = '\0';
+  
+  s = mpcf_escape_new(
+    members,
+    mpc_escape_input_c,
+    mpc_escape_output_c);
+  printf(comp ? "[^%s]" : "[%s]", s);
+  free(s);
+}
+
 static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   /* TODO: Print Everything Escaped */
@@ -2641,22 +6053,28 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(e);
   }
   
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
+  if (p->type == MPC_TYPE_SET && p->data.set.n > 0) {
+    printf("(");
+    for(i = 0; i < p->data.set.n-1; i++) {
+      mpc_print_unretained(p->data.set.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.set.xs[p->data.set.n-1], 0);
+    printf(")");
   }
   
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
+  if (p->type == MPC_TYPE_TRIE) {
+    printf("(");
+    for(i = 0; i < p->data.trie.n-1; i++) {
+      mpc_print_unretained(p->data.trie.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.trie.xs[p->data.trie.n-1], 0);
+    printf(")");
+  }
+  
+  if (p->type == MPC_TYPE_SET && p->data.set.n == 0) {
+    mpc_print_set(p->data.set.x);
   }
   
   if (p->type == MPC_TYPE_STRING) {
@@ -2668,9 +6086,11 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2785,20 +6205,106 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Nodes waiting to be deleted are kept on a stack
+** rather than recursed into, so trees as deep as
+** the parser can now build are freed safely.
+*/
+
+enum {
+  MPC_AST_STACK_MIN = 64
+};
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
-  int i;
+  int i, n = 1, slots = MPC_AST_STACK_MIN;
+  mpc_ast_t *stack_stk[MPC_AST_STACK_MIN];
+  mpc_ast_t **stack = stack_stk;
   
   if (a == NULL) { return; }
   
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  stack[0] = a;
+  
+  while (n > 0) {
+    
+    a = stack[--n];
+    
+    if (n + a->children_num > slots) {
+      slots = (n + a->children_num) * 2;
+      if (stack == stack_stk) {
+        stack = malloc(sizeof(mpc_ast_t*) * slots);
+        memcpy(stack, stack_stk, sizeof(mpc_ast_t*) * n);
+      } else {
+        stack = realloc(stack, sizeof(mpc_ast_t*) * slots);
+      }
+    }
+    
+    for (i = 0; i < a->children_num; i++) {
+      if (a->children[i]) { stack[n++] = a->children[i]; }
+    }
+    
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  if (stack != stack_stk) { free(stack); }
+  
+}
+
+typedef struct {
+  mpc_ast_t *a;
+  mpc_ast_t **b;
+} mpc_ast_copy_t;
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i, n = 1, slots = MPC_AST_STACK_MIN;
+  mpc_ast_copy_t stack_stk[MPC_AST_STACK_MIN];
+  mpc_ast_copy_t *stack = stack_stk;
+  mpc_ast_t *r = NULL, *b, **o;
+  
+  if (a == NULL) { return NULL; }
+  
+  stack[0].a = a;
+  stack[0].b = &r;
+  
+  while (n > 0) {
+    
+    a = stack[--n].a;
+    o = stack[n].b;
+    b = *o = mpc_ast_new(a->tag, a->contents);
+    b->state = a->state;
+    
+    if (a->children_num == 0) { continue; }
+    
+    if (n + a->children_num > slots) {
+      slots = (n + a->children_num) * 2;
+      if (stack == stack_stk) {
+        stack = malloc(sizeof(mpc_ast_copy_t) * slots);
+        memcpy(stack, stack_stk, sizeof(mpc_ast_copy_t) * n);
+      } else {
+        stack = realloc(stack, sizeof(mpc_ast_copy_t) * slots);
+      }
+    }
+    
+    b->children_num = a->children_num;
+    b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+    
+    for (i = 0; i < a->children_num; i++) {
+      b->children[i] = NULL;
+      if (a->children[i]) {
+        stack[n].a = a->children[i];
+        stack[n].b = &b->children[i];
+        n++;
+      }
+    }
+  }
+  
+  if (stack != stack_stk) { free(stack); }
+  
+  return r;
   
 }
 
@@ -3233,6 +6739,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memoize(mpc_parser_t *a) { return mpc_memoize(a, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
 ** Grammar Parser
@@ -3547,6 +7054,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  int i;
 
   while(*stmts) {
     stmt = *stmts;
@@ -3561,6 +7069,11 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmts++;
   }
   
+  /* Rules can use ones defined after them */
+  for (i = 0; i < st->parsers_num; i++) {
+    mpc_dispatch_refresh(st->parsers[i], 1);
+  }
+  
   free(x);
   
   return NULL;
@@ -3724,7 +7237,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_mmap(filename, f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3744,9 +7257,11 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
   if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
 
+  if (p->type == MPC_TYPE_DFA)      { return mpc_nodecount_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3758,6 +7273,22 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
+  if (p->type == MPC_TYPE_SET) { 
+    total = 1;
+    for(i = 0; i < p->data.set.n; i++) {
+      total += mpc_nodecount_unretained(p->data.set.xs[i], 0);
+    }
+    return total;
+  }
+  
+  if (p->type == MPC_TYPE_TRIE) { 
+    total = 1;
+    for(i = 0; i < p->data.trie.n; i++) {
+      total += mpc_nodecount_unretained(p->data.trie.xs[i], 0);
+    }
+    return total;
+  }
+  
   if (p->type == MPC_TYPE_OR) { 
     total = 1;
     for(i = 0; i < p->data.or.n; i++) {
@@ -3784,10 +7315,373 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** An `or` can be folded into a single set when every
+** alternative is an unretained single character, range
+** or set, optionally under an unretained `expect`.
+*/
+
+static mpc_parser_t *mpc_optimise_set_member(mpc_parser_t *p) {
+  
+  if (p->retained) { return NULL; }
+  if (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->retained) { return NULL; }
+  
+  if (p->type == MPC_TYPE_SINGLE
+  ||  p->type == MPC_TYPE_RANGE
+  ||  p->type == MPC_TYPE_SET) { return p; }
+  
+  return NULL;
+}
+
+static int mpc_optimise_set_foldable(mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    if (!mpc_optimise_set_member(p->data.or.xs[i])) { return 0; }
+  }
+  return 1;
+}
+
+/*
+** A set folded from an `or` at the edge of another
+** `or` is turned back into an `or`, so that the two
+** can still be merged and then folded as a whole.
+** Tries are left alone, as a run of strings is folded
+** again wherever it is in an `or`.
+*/
+
+static int mpc_optimise_set_unfold(mpc_parser_t *p) {
+  
+  int n;
+  mpc_parser_t **xs;
+  
+  if (p->retained || p->type != MPC_TYPE_SET || p->data.set.n == 0) { return 0; }
+  
+  n = p->data.set.n; xs = p->data.set.xs;
+  free(p->data.set.x);
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = xs;
+  p->data.or.d = NULL;
+  return 1;
+}
+
+/*
+** A run of alternatives in an `or` can be folded
+** into a trie when they are all strings, characters,
+** ranges, sets or tries, optionally under an
+** unretained `expect`, and not all can be a set.
+*/
+
+static mpc_parser_t *mpc_optimise_trie_member(mpc_parser_t *p) {
+  
+  if (p->retained) { return NULL; }
+  if (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->retained) { return NULL; }
+  
+  if (p->type == MPC_TYPE_SINGLE
+  ||  p->type == MPC_TYPE_RANGE
+  ||  p->type == MPC_TYPE_SET
+  ||  p->type == MPC_TYPE_TRIE
+  || (p->type == MPC_TYPE_STRING && p->data.string.x[0] != '\0')) { return p; }
+  
+  return NULL;
+}
+
+static int mpc_optimise_trie_fold(mpc_parser_t *p) {
+  
+  int a, b, j, k, m, s, n = p->data.or.n;
+  mpc_parser_t *t, **ys, **xs = p->data.or.xs;
+  
+  for (a = 0; a < n; a = b + 1) {
+    s = 0;
+    for (b = a; b < n && mpc_optimise_trie_member(xs[b]); b++) {
+      if (!mpc_optimise_set_member(xs[b])) { s = 1; }
+    }
+    if (s && b - a > 1) { break; }
+  }
+  
+  if (a >= n) { return 0; }
+  
+  /* Tries folded already are merged into the new one */
+  
+  for (m = 0, j = a; j < b; j++) {
+    m += xs[j]->type == MPC_TYPE_TRIE ? xs[j]->data.trie.n : 1;
+  }
+  
+  ys = malloc(sizeof(mpc_parser_t*) * m);
+  
+  for (k = 0, j = a; j < b; j++) {
+    t = xs[j];
+    if (t->type != MPC_TYPE_TRIE) { ys[k++] = t; continue; }
+    memcpy(ys + k, t->data.trie.xs, sizeof(mpc_parser_t*) * t->data.trie.n);
+    k += t->data.trie.n;
+    mpc_trie_delete(t->data.trie.t);
+    free(t->data.trie.xs); free(t->name); free(t);
+  }
+  
+  if (b - a == n) {
+    mpc_dispatch_delete(p->data.or.d);
+    free(xs);
+    p->type = MPC_TYPE_TRIE;
+    p->data.trie.n = m;
+    p->data.trie.xs = ys;
+    p->data.trie.t = mpc_trie_new(m, ys);
+    return 1;
+  }
+  
+  t = mpc_undefined();
+  t->type = MPC_TYPE_TRIE;
+  t->data.trie.n = m;
+  t->data.trie.xs = ys;
+  t->data.trie.t = mpc_trie_new(m, ys);
+  mpc_span_update(t);
+  
+  xs[a] = t;
+  memmove(xs + a + 1, xs + b, sizeof(mpc_parser_t*) * (n - b));
+  p->data.or.n = n - (b - a) + 1;
+  return 1;
+}
+
+/*
+** Alternatives that wrap literals in the same way,
+** as `mpca_lang` does with its tokens, can share one
+** copy of the wrapping around an `or` of the literals
+** which is then folded. This needs everything the
+** wrapping runs before a literal to be empty, and
+** everything after it to never fail.
+*/
+
+static int mpc_optimise_total(mpc_parser_t *p) {
+  
+  int i;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      return 1;
+    
+    case MPC_TYPE_EXPECT:   return mpc_optimise_total(p->data.expect.x);
+    case MPC_TYPE_APPLY:    return mpc_optimise_total(p->data.apply.x);
+    case MPC_TYPE_APPLY_TO: return mpc_optimise_total(p->data.apply_to.x);
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_optimise_total(p->data.and.xs[i])) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_optimise_same(mpc_parser_t *a, mpc_parser_t *b) {
+  
+  int i;
+  
+  if (a == b) { return 1; }
+  if (a->retained || b->retained || a->type != b->type) { return 0; }
+  
+  switch (a->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+      return 1;
+    
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+      return a->data.lift.lf == b->data.lift.lf && a->data.lift.x == b->data.lift.x;
+    
+    case MPC_TYPE_FAIL:    return strcmp(a->data.fail.m, b->data.fail.m) == 0;
+    case MPC_TYPE_ANCHOR:  return a->data.anchor.f == b->data.anchor.f;
+    case MPC_TYPE_SINGLE:  return a->data.single.x == b->data.single.x;
+    case MPC_TYPE_SATISFY: return a->data.satisfy.f == b->data.satisfy.f;
+    case MPC_TYPE_STRING:  return strcmp(a->data.string.x, b->data.string.x) == 0;
+    
+    case MPC_TYPE_RANGE:
+      return a->data.range.x == b->data.range.x && a->data.range.y == b->data.range.y;
+    
+    case MPC_TYPE_SET:
+      if (memcmp(a->data.set.x, b->data.set.x, MPC_SET_BYTES) != 0
+      ||  a->data.set.n != b->data.set.n) { return 0; }
+      for (i = 0; i < a->data.set.n; i++) {
+        if (!mpc_optimise_same(a->data.set.xs[i], b->data.set.xs[i])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_EXPECT:
+      return a->data.expect.h == b->data.expect.h
+        && strcmp(a->data.expect.m, b->data.expect.m) == 0
+        && mpc_optimise_same(a->data.expect.x, b->data.expect.x);
+    
+    case MPC_TYPE_APPLY:
+      return a->data.apply.f == b->data.apply.f
+        && mpc_optimise_same(a->data.apply.x, b->data.apply.x);
+    
+    case MPC_TYPE_APPLY_TO:
+      return a->data.apply_to.f == b->data.apply_to.f
+        && a->data.apply_to.d == b->data.apply_to.d
+        && mpc_optimise_same(a->data.apply_to.x, b->data.apply_to.x);
+    
+    case MPC_TYPE_PREDICT:
+      return mpc_optimise_same(a->data.predict.x, b->data.predict.x);
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return a->data.not.dx == b->data.not.dx
+        && a->data.not.lf == b->data.not.lf
+        && mpc_optimise_same(a->data.not.x, b->data.not.x);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return a->data.repeat.n == b->data.repeat.n
+        && a->data.repeat.f == b->data.repeat.f
+        && a->data.repeat.dx == b->data.repeat.dx
+        && mpc_optimise_same(a->data.repeat.x, b->data.repeat.x);
+    
+    case MPC_TYPE_OR:
+      if (a->data.or.n != b->data.or.n) { return 0; }
+      for (i = 0; i < a->data.or.n; i++) {
+        if (!mpc_optimise_same(a->data.or.xs[i], b->data.or.xs[i])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      if (a->data.and.n != b->data.and.n || a->data.and.f != b->data.and.f) { return 0; }
+      for (i = 0; i < a->data.and.n; i++) {
+        if (!mpc_optimise_same(a->data.and.xs[i], b->data.and.xs[i])) { return 0; }
+        if (i < a->data.and.n-1 && a->data.and.dxs[i] != b->data.and.dxs[i]) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static mpc_parser_t **mpc_optimise_hole(mpc_parser_t *p) {
+  
+  int i, j;
+  
+  if (p->retained) { return NULL; }
+  if (p->type == MPC_TYPE_APPLY)    { return &p->data.apply.x; }
+  if (p->type == MPC_TYPE_APPLY_TO) { return &p->data.apply_to.x; }
+  if (p->type != MPC_TYPE_AND)      { return NULL; }
+  
+  for (j = 0; j < p->data.and.n; j++) {
+    if (p->data.and.xs[j]->retained || !mpc_first_empty(p->data.and.xs[j])) { break; }
+  }
+  
+  if (j == p->data.and.n) { return NULL; }
+  
+  for (i = j+1; i < p->data.and.n; i++) {
+    if (!mpc_optimise_total(p->data.and.xs[i])) { return NULL; }
+  }
+  
+  return &p->data.and.xs[j];
+}
+
+static int mpc_optimise_wrapped(mpc_parser_t *a, mpc_parser_t *b) {
+  
+  int i, j;
+  mpc_parser_t **x = mpc_optimise_hole(a), **y = mpc_optimise_hole(b);
+  
+  if (x == NULL || y == NULL || a->type != b->type) { return 0; }
+  
+  if (a->type == MPC_TYPE_APPLY && a->data.apply.f != b->data.apply.f) { return 0; }
+  
+  if (a->type == MPC_TYPE_APPLY_TO
+  && (a->data.apply_to.f != b->data.apply_to.f
+  ||  a->data.apply_to.d != b->data.apply_to.d)) { return 0; }
+  
+  if (a->type == MPC_TYPE_AND) {
+    
+    j = (int)(x - a->data.and.xs);
+    
+    if (a->data.and.n != b->data.and.n
+    ||  a->data.and.f != b->data.and.f
+    ||  j != (int)(y - b->data.and.xs)) { return 0; }
+    
+    for (i = 0; i < a->data.and.n; i++) {
+      if (i != j && !mpc_optimise_same(a->data.and.xs[i], b->data.and.xs[i])) { return 0; }
+      if (i < a->data.and.n-1 && a->data.and.dxs[i] != b->data.and.dxs[i]) { return 0; }
+    }
+  }
+  
+  if (mpc_optimise_trie_member(*x) && mpc_optimise_trie_member(*y)) { return 1; }
+  
+  return mpc_optimise_wrapped(*x, *y);
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force);
+
+static mpc_parser_t **mpc_optimise_literal(mpc_parser_t *p) {
+  mpc_parser_t **x = mpc_optimise_hole(p);
+  while (!mpc_optimise_trie_member(*x)) { x = mpc_optimise_hole(*x); }
+  return x;
+}
+
+static int mpc_optimise_hoist(mpc_parser_t *p) {
+  
+  int a, b, j, n = p->data.or.n;
+  mpc_parser_t *t, **x, **xs = p->data.or.xs;
+  
+  for (a = 0; a < n - 1; a = b) {
+    for (b = a + 1; b < n && mpc_optimise_wrapped(xs[a], xs[b]); b++) {}
+    if (b - a > 1) { break; }
+  }
+  
+  if (a >= n - 1) { return 0; }
+  
+  t = mpc_undefined();
+  t->type = MPC_TYPE_OR;
+  t->data.or.n = b - a;
+  t->data.or.xs = malloc(sizeof(mpc_parser_t*) * (b - a));
+  t->data.or.d = NULL;
+  
+  for (j = b - 1; j >= a; j--) {
+    x = mpc_optimise_literal(xs[j]);
+    t->data.or.xs[j - a] = *x;
+    if (j == a) { *x = t; break; }
+    *x = mpc_pass();
+    mpc_undefine_unretained(xs[j], 0);
+  }
+  
+  mpc_optimise_unretained(xs[a], 0);
+  memmove(xs + a + 1, xs + b, sizeof(mpc_parser_t*) * (n - b));
+  p->data.or.n = n - (b - a) + 1;
+  
+  /* Both the `or` and the one it wraps fail without an error of their own */
+  
+  if (p->data.or.n == 1) {
+    t = xs[0];
+    mpc_dispatch_delete(p->data.or.d);
+    free(xs);
+    p->type = t->type;
+    p->data = t->data;
+    p->span = t->span;
+    free(t->name);
+    free(t);
+  }
+  
+  return 1;
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
   int i, n, m;
-  mpc_parser_t *t;
+  mpc_parser_t *t, **xs;
+  unsigned char *x;
   
   if (p->retained && !force) { return; }
   
@@ -3799,6 +7693,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3811,6 +7706,18 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
     }
   }
   
+  if (p->type == MPC_TYPE_SET) { 
+    for(i = 0; i < p->data.set.n; i++) {
+      mpc_optimise_unretained(p->data.set.xs[i], 0);
+    }
+  }
+  
+  if (p->type == MPC_TYPE_TRIE) { 
+    for(i = 0; i < p->data.trie.n; i++) {
+      mpc_optimise_unretained(p->data.trie.xs[i], 0);
+    }
+  }
+  
   if (p->type == MPC_TYPE_AND) {
     for(i = 0; i < p->data.and.n; i++) {
       mpc_optimise_unretained(p->data.and.xs[i], 0);
@@ -3821,6 +7728,14 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
   while (1) {
     
+    /* Unfold edge `or` sets */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n > 0
+    &&  (mpc_optimise_set_unfold(p->data.or.xs[p->data.or.n-1])
+    ||   mpc_optimise_set_unfold(p->data.or.xs[0]))) {
+      continue;
+    }
+    
     /* Merge rhs `or` */
     if (p->type == MPC_TYPE_OR
     &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
@@ -3830,6 +7745,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_dispatch_delete(t->data.or.d);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3844,10 +7760,42 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_dispatch_delete(t->data.or.d);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
     
+    /* Fold character `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n > 1
+    &&  mpc_optimise_set_foldable(p)) {
+      x = calloc(1, MPC_SET_BYTES);
+      for (i = 0; i < p->data.or.n; i++) {
+        mpc_set_add(x, mpc_optimise_set_member(p->data.or.xs[i]));
+      }
+      n = p->data.or.n; xs = p->data.or.xs;
+      mpc_dispatch_delete(p->data.or.d);
+      p->type = MPC_TYPE_SET;
+      p->data.set.x = x;
+      p->data.set.n = n;
+      p->data.set.xs = xs;
+      continue;
+    }
+    
+    /* Fold string `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n > 1
+    &&  mpc_optimise_trie_fold(p)) {
+      continue;
+    }
+    
+    /* Hoist shared wrapping in `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n > 1
+    &&  mpc_optimise_hoist(p)) {
+      continue;
+    }
+    
     /* Remove ast `pass` */
     if (p->type == MPC_TYPE_AND
     &&  p->data.and.n == 2
@@ -3947,6 +7895,9 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    if (p->type == MPC_TYPE_OR && p->data.or.n > 1) { mpc_dispatch_build(p); }
+    
+    mpc_span_update(p);
     return;
     
   }
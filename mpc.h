@@ -66,10 +66,33 @@ typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Parses `file` from its current position to the end. Regular files
+** are mapped and anything else is read in blocks; either way the file
+** is left positioned at its end.
+*/
+int mpc_parse_mmap(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parse Contexts
+*/
+
+struct mpc_parse_ctx_t;
+typedef struct mpc_parse_ctx_t mpc_parse_ctx_t;
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(void);
+void mpc_parse_ctx_reset(mpc_parse_ctx_t *c);
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c);
+void mpc_parse_ctx_mem_stats(mpc_parse_ctx_t *c, unsigned long *hits, unsigned long *fallbacks);
+
+int mpc_parse_ctx_view(mpc_parse_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -146,6 +169,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memoize(mpc_parser_t *a, mpc_apply_t cp, mpc_dtor_t da);
 
 /*
 ** Common Parsers
@@ -284,6 +308,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -327,6 +352,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memoize(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
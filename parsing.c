@@ -1,91 +1,393 @@
 #include <editline/readline.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
 #include "mpc.h"
 
+//Only one variant is live per node, so they share storage. count sits in the padding after
+//type, which keeps the header at 16 bytes on LP64. Boxed numbers, errors and symbols are
+//only the header, so four fit in a cache line; an error's message and a symbol's interned
+//name live elsewhere. S- and Q-expressions carry LISP_INLINE_CELLS child pointers after the
+//header, 48 bytes in all, and move their children to a separate array once those fill.
+//Small numbers are not allocated at all, see the immediates below.
 typedef struct lisp_value {
     int type;
-    long number;
-    char* error;
-    char* symbol;
     int count;
-    struct lisp_value** cell;
+    union {
+        long number;
+        char* error;
+        struct lisp_symbol* symbol;
+        struct lisp_value** cell;
+    } as;
 } lisp_value;
 
 enum { VALUE_NUMBER, VALUE_ERROR, VALUE_SYMBOL, VALUE_S_EXPRESSION, VALUE_Q_EXPRESSION };
 
+//Numbers that fit in all but one bit of a pointer are stored inline in the lisp_value*
+//itself with the low bit set, so they are never allocated. Heap nodes are always at least
+//2-byte aligned, which keeps the low bit of a real pointer clear. Any number outside
+//LISP_IMMEDIATE_MIN..LISP_IMMEDIATE_MAX still gets a boxed VALUE_NUMBER node, whether it
+//was read from a literal above LONG_MAX / 2 in magnitude or came out of arithmetic.
+#define LISP_IMMEDIATE_MIN (LONG_MIN / 2)
+#define LISP_IMMEDIATE_MAX (LONG_MAX / 2)
+
+int lisp_value_is_immediate(lisp_value* value) {
+    return ((uintptr_t)value & 1) != 0;
+}
+
+int lisp_value_type(lisp_value* value) {
+    return lisp_value_is_immediate(value) ? VALUE_NUMBER : value->type;
+}
+
+long lisp_value_as_number(lisp_value* value) {
+    return lisp_value_is_immediate(value) ? (long)((intptr_t)value >> 1) : value->as.number;
+}
+
+//Evaluation arena. While an arena is active every lisp_value, string and cell array is
+//bump allocated from it and lisp_value_delete does nothing; the whole line is released at
+//once by lisp_arena_reset. With no active arena allocation falls through to malloc.
+#define LISP_ARENA_CHUNK_SIZE (64 * 1024)
+#define LISP_ARENA_ALIGNMENT sizeof(long)
+
+typedef struct lisp_arena_chunk {
+    struct lisp_arena_chunk* next;
+    size_t size;
+    size_t used;
+    char* data;
+} lisp_arena_chunk;
+
+typedef struct lisp_arena {
+    lisp_arena_chunk* head;
+} lisp_arena;
+
+lisp_arena* lisp_active_arena = NULL;
+
+void lisp_arena_init(lisp_arena* arena) {
+    arena->head = NULL;
+}
+
+lisp_arena_chunk* lisp_arena_chunk_new(size_t size, lisp_arena_chunk* next) {
+    lisp_arena_chunk* chunk = malloc(sizeof(lisp_arena_chunk) + size);
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->data = (char*)(chunk + 1);
+    return chunk;
+}
+
+void* lisp_arena_allocate(lisp_arena* arena, size_t size) {
+    size = (size + LISP_ARENA_ALIGNMENT - 1) & ~(LISP_ARENA_ALIGNMENT - 1);
+    lisp_arena_chunk* chunk = arena->head;
+    if(chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk ? chunk->size * 2 : LISP_ARENA_CHUNK_SIZE;
+        while(chunk_size < size) {
+            chunk_size *= 2;
+        }
+        chunk = arena->head = lisp_arena_chunk_new(chunk_size, chunk);
+    }
+    void* pointer = chunk->data + chunk->used;
+    chunk->used += size;
+    return pointer;
+}
+
+//Keeps only the newest, largest chunk so the next line starts without calling malloc.
+void lisp_arena_reset(lisp_arena* arena) {
+    if(arena->head == NULL) {
+        return;
+    }
+    lisp_arena_chunk* chunk = arena->head->next;
+    while(chunk) {
+        lisp_arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+void lisp_arena_free(lisp_arena* arena) {
+    lisp_arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+void* lisp_allocate(size_t size) {
+    if(lisp_active_arena) {
+        return lisp_arena_allocate(lisp_active_arena, size);
+    }
+    return malloc(size);
+}
+
+//Arena blocks cannot be resized in place, so growing copies into a fresh block and
+//shrinking keeps the old one.
+void* lisp_reallocate(void* pointer, size_t old_size, size_t new_size) {
+    if(lisp_active_arena == NULL) {
+        return realloc(pointer, new_size);
+    }
+    if(new_size <= old_size) {
+        return pointer;
+    }
+    void* moved = lisp_arena_allocate(lisp_active_arena, new_size);
+    memcpy(moved, pointer, old_size);
+    return moved;
+}
+
+//Symbols are interned into a global hash table when they are read, so every occurrence of a
+//name shares one lisp_symbol and symbol equality is pointer equality. The builtin a name
+//refers to is resolved once, when it is first interned. Entries live for the whole program,
+//outside any evaluation arena.
+enum {
+    BUILTIN_LIST, BUILTIN_HEAD, BUILTIN_TAIL, BUILTIN_JOIN, BUILTIN_EVALUATE,
+    BUILTIN_ADD, BUILTIN_SUBTRACT, BUILTIN_MULTIPLY, BUILTIN_DIVIDE, BUILTIN_UNKNOWN
+};
+
+int builtin_lookup(char* name) {
+    if(strcmp("list", name) == 0) {
+        return BUILTIN_LIST;
+    }
+    if(strcmp("head", name) == 0) {
+        return BUILTIN_HEAD;
+    }
+    if(strcmp("tail", name) == 0) {
+        return BUILTIN_TAIL;
+    }
+    if(strcmp("join", name) == 0) {
+        return BUILTIN_JOIN;
+    }
+    if(strcmp("evaluate", name) == 0) {
+        return BUILTIN_EVALUATE;
+    }
+    if(strcmp("+", name) == 0) {
+        return BUILTIN_ADD;
+    }
+    if(strcmp("-", name) == 0) {
+        return BUILTIN_SUBTRACT;
+    }
+    if(strcmp("*", name) == 0) {
+        return BUILTIN_MULTIPLY;
+    }
+    if(strcmp("/", name) == 0) {
+        return BUILTIN_DIVIDE;
+    }
+    return BUILTIN_UNKNOWN;
+}
+
+typedef struct lisp_symbol {
+    char* name;
+    int builtin;
+    unsigned long hash;
+    struct lisp_symbol* next;
+} lisp_symbol;
+
+typedef struct lisp_symbol_table {
+    int count;
+    int capacity;
+    lisp_symbol** buckets;
+} lisp_symbol_table;
+
+lisp_symbol_table lisp_symbols = { 0, 0, NULL };
+
+unsigned long lisp_symbol_hash(char* name) {
+    unsigned long hash = 2166136261u;
+    for(unsigned char* c = (unsigned char*)name; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+void lisp_symbol_table_grow(lisp_symbol_table* table) {
+    int capacity = table->capacity ? table->capacity * 2 : 64;
+    lisp_symbol** buckets = calloc(capacity, sizeof(lisp_symbol*));
+    for(int i = 0; i < table->capacity; i++) {
+        lisp_symbol* symbol = table->buckets[i];
+        while(symbol) {
+            lisp_symbol* next = symbol->next;
+            symbol->next = buckets[symbol->hash & (capacity - 1)];
+            buckets[symbol->hash & (capacity - 1)] = symbol;
+            symbol = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->capacity = capacity;
+}
+
+lisp_symbol* lisp_symbol_intern(char* name) {
+    unsigned long hash = lisp_symbol_hash(name);
+    if(lisp_symbols.capacity) {
+        for(lisp_symbol* symbol = lisp_symbols.buckets[hash & (lisp_symbols.capacity - 1)]; symbol; symbol = symbol->next) {
+            if(symbol->hash == hash && strcmp(symbol->name, name) == 0) {
+                return symbol;
+            }
+        }
+    }
+    if(lisp_symbols.count >= lisp_symbols.capacity) {
+        lisp_symbol_table_grow(&lisp_symbols);
+    }
+    lisp_symbol* symbol = malloc(sizeof(lisp_symbol));
+    symbol->name = malloc(strlen(name) + 1);
+    strcpy(symbol->name, name);
+    symbol->builtin = builtin_lookup(name);
+    symbol->hash = hash;
+    symbol->next = lisp_symbols.buckets[hash & (lisp_symbols.capacity - 1)];
+    lisp_symbols.buckets[hash & (lisp_symbols.capacity - 1)] = symbol;
+    lisp_symbols.count++;
+    return symbol;
+}
+
+void lisp_symbol_table_free(lisp_symbol_table* table) {
+    for(int i = 0; i < table->capacity; i++) {
+        lisp_symbol* symbol = table->buckets[i];
+        while(symbol) {
+            lisp_symbol* next = symbol->next;
+            free(symbol->name);
+            free(symbol);
+            symbol = next;
+        }
+    }
+    free(table->buckets);
+    table->count = 0;
+    table->capacity = 0;
+    table->buckets = NULL;
+}
+
 lisp_value* lisp_value_number(long x) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    if(x >= LISP_IMMEDIATE_MIN && x <= LISP_IMMEDIATE_MAX) {
+        return (lisp_value*)(((uintptr_t)(intptr_t)x << 1) | 1);
+    }
+    lisp_value* value = lisp_allocate(sizeof(lisp_value));
     value->type = VALUE_NUMBER;
-    value->number = x;
+    value->as.number = x;
     return value;
 }
 
 lisp_value* lisp_value_error(char* message) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+    lisp_value* value = lisp_allocate(sizeof(lisp_value));
     value->type = VALUE_ERROR;
-    value->error = malloc(strlen(message) + 1);
-    strcpy(value->error, message);
+    value->as.error = lisp_allocate(strlen(message) + 1);
+    strcpy(value->as.error, message);
     return value;
 }
 
-lisp_value* lisp_value_symbol(char* symbol) {
-    lisp_value* value = malloc(sizeof(lisp_value));
+lisp_value* lisp_value_interned_symbol(lisp_symbol* symbol) {
+    lisp_value* value = lisp_allocate(sizeof(lisp_value));
     value->type = VALUE_SYMBOL;
-    value->symbol = malloc(strlen(symbol) + 1);
-    strcpy(value->symbol, symbol);
+    value->as.symbol = symbol;
     return value;
 }
 
-lisp_value* lisp_value_s_expression(void) {
-    lisp_value* value = malloc(sizeof(lisp_value));
-    value->type = VALUE_S_EXPRESSION;
+lisp_value* lisp_value_symbol(char* name) {
+    return lisp_value_interned_symbol(lisp_symbol_intern(name));
+}
+
+//Expressions are allocated with room for LISP_INLINE_CELLS children directly after the
+//node, so short lists need no separate cell array. Past that the array lives on its own
+//and doubles whenever it fills. The capacity is not stored: it is always the smallest
+//power of two, at least LISP_INLINE_CELLS, that holds count, and cells are never given
+//back on removal, so the real capacity is never below that.
+#define LISP_INLINE_CELLS 4
+
+lisp_value** lisp_value_inline_cells(lisp_value* value) {
+    return (lisp_value**)(value + 1);
+}
+
+int lisp_value_capacity(int count) {
+    int capacity = LISP_INLINE_CELLS;
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+lisp_value* lisp_value_expression(int type) {
+    lisp_value* value = lisp_allocate(sizeof(lisp_value) + sizeof(lisp_value*) * LISP_INLINE_CELLS);
+    value->type = type;
     value->count = 0;
-    value->cell = NULL;
+    value->as.cell = lisp_value_inline_cells(value);
     return value;
 }
 
+lisp_value* lisp_value_s_expression(void) {
+    return lisp_value_expression(VALUE_S_EXPRESSION);
+}
+
 lisp_value* lisp_value_q_expression(void) {
-    lisp_value* value = malloc(sizeof(lisp_value));
-    value->type = VALUE_Q_EXPRESSION;
-    value->count = 0;
-    value->cell = NULL;
-    return value;
+    return lisp_value_expression(VALUE_Q_EXPRESSION);
 }
 
 void lisp_value_delete(lisp_value* value) {
-    switch (value->type) {
+    if(lisp_value_is_immediate(value) || lisp_active_arena) {
+        return;
+    }
+    switch (lisp_value_type(value)) {
         case VALUE_NUMBER:
             break;
         case VALUE_ERROR:
-            free(value->error);
+            free(value->as.error);
             break;
         case VALUE_SYMBOL:
-            free(value->symbol);
             break;
         case VALUE_Q_EXPRESSION:
         case VALUE_S_EXPRESSION:
             for(int i = 0; i < value->count; i++) {
-                lisp_value_delete(value->cell[i]);
+                lisp_value_delete(value->as.cell[i]);
+            }
+            if(value->as.cell != lisp_value_inline_cells(value)) {
+                free(value->as.cell);
             }
-            free(value->cell);
             break;
     }
     free(value);
 }
 
-lisp_value* lisp_value_read_number(mpc_ast_t* tree) {
+lisp_value* lisp_value_read_digits(char* digits, char** end) {
     errno = 0;
-    long x = strtol(tree->contents, NULL, 10);
+    long x = strtol(digits, end, 10);
     return errno != ERANGE ?
         lisp_value_number(x) : lisp_value_error("Invalid number. Internal datatype is a long int, so stay below signed 2^32 range.\n");
 }
 
+lisp_value* lisp_value_read_number(mpc_ast_t* tree) {
+    return lisp_value_read_digits(tree->contents, NULL);
+}
+
 lisp_value* lisp_value_add(lisp_value* value, lisp_value* child) {
-    value->count++;
-    value->cell = realloc(value->cell, sizeof(lisp_value*) * value->count);
-    value->cell[value->count - 1] = child;
+    if(value->count == lisp_value_capacity(value->count)) {
+        size_t size = sizeof(lisp_value*) * value->count;
+        if(value->as.cell == lisp_value_inline_cells(value)) {
+            lisp_value** cell = lisp_allocate(size * 2);
+            memcpy(cell, value->as.cell, size);
+            value->as.cell = cell;
+        } else {
+            value->as.cell = lisp_reallocate(value->as.cell, size, size * 2);
+        }
+    }
+    value->as.cell[value->count++] = child;
     return value;
 }
 
+lisp_value* lisp_value_copy(lisp_value* value) {
+    lisp_value* copy;
+    switch (lisp_value_type(value)) {
+        case VALUE_NUMBER:
+            return lisp_value_number(lisp_value_as_number(value));
+        case VALUE_ERROR:
+            return lisp_value_error(value->as.error);
+        case VALUE_SYMBOL:
+            return lisp_value_interned_symbol(value->as.symbol);
+        case VALUE_S_EXPRESSION:
+        case VALUE_Q_EXPRESSION:
+            copy = lisp_value_type(value) == VALUE_S_EXPRESSION ? lisp_value_s_expression() : lisp_value_q_expression();
+            for(int i = 0; i < value->count; i++) {
+                copy = lisp_value_add(copy, lisp_value_copy(value->as.cell[i]));
+            }
+            return copy;
+    }
+    return NULL;
+}
+
 lisp_value* lisp_value_read(mpc_ast_t* tree) {
     if(strstr(tree->tag, "number")) {
         return lisp_value_read_number(tree);
@@ -127,50 +429,228 @@ lisp_value* lisp_value_read(mpc_ast_t* tree) {
     return expressions;
 }
 
-//lisp_value_print forward declaration
-void lisp_value_print(lisp_value* value);
+//Direct reader. Builds lisp_values straight from the input text without an intermediate
+//mpc_ast_t, following the grammar in main token by token: whitespace after every token,
+//numbers tried before the '-' symbol, and symbols matched as fixed keywords. Any syntax
+//error makes the whole read fail with NULL, and the caller re-parses with mpc to report it.
+char* lisp_reader_keywords[] = { "+", "-", "*", "/", "list", "head", "tail", "join", "evaluate" };
+
+void lisp_reader_skip_whitespace(char** cursor) {
+    while(**cursor != '\0' && strchr(" \f\n\r\t\v", **cursor)) {
+        (*cursor)++;
+    }
+}
+
+int lisp_reader_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+//lisp_reader_expressions forward declaration
+lisp_value* lisp_reader_expressions(char** cursor, lisp_value* expressions, char close);
+
+//Reads one expression at the cursor. Returns NULL without moving the cursor if none starts there.
+lisp_value* lisp_reader_expression(char** cursor) {
+    char* start = *cursor;
+    lisp_value* value = NULL;
+    if(lisp_reader_is_digit(start[0]) || (start[0] == '-' && lisp_reader_is_digit(start[1]))) {
+        value = lisp_value_read_digits(start, cursor);
+    } else if(start[0] == '(') {
+        (*cursor)++;
+        lisp_reader_skip_whitespace(cursor);
+        value = lisp_reader_expressions(cursor, lisp_value_s_expression(), ')');
+    } else if(start[0] == '{') {
+        (*cursor)++;
+        lisp_reader_skip_whitespace(cursor);
+        value = lisp_reader_expressions(cursor, lisp_value_q_expression(), '}');
+    } else {
+        for(int i = 0; i < (int)(sizeof(lisp_reader_keywords) / sizeof(char*)); i++) {
+            size_t length = strlen(lisp_reader_keywords[i]);
+            if(strncmp(start, lisp_reader_keywords[i], length) == 0) {
+                value = lisp_value_symbol(lisp_reader_keywords[i]);
+                *cursor += length;
+                break;
+            }
+        }
+    }
+    if(value) {
+        lisp_reader_skip_whitespace(cursor);
+    }
+    return value;
+}
+
+//Reads expressions into expressions until the close character, which is consumed. A close
+//of '\0' means the end of the input. Returns NULL and frees expressions on a syntax error.
+lisp_value* lisp_reader_expressions(char** cursor, lisp_value* expressions, char close) {
+    while(**cursor != close) {
+        lisp_value* child = lisp_reader_expression(cursor);
+        if(child == NULL) {
+            lisp_value_delete(expressions);
+            return NULL;
+        }
+        expressions = lisp_value_add(expressions, child);
+    }
+    if(close != '\0') {
+        (*cursor)++;
+    }
+    return expressions;
+}
+
+lisp_value* lisp_read(char* input) {
+    lisp_reader_skip_whitespace(&input);
+    return lisp_reader_expressions(&input, lisp_value_s_expression(), '\0');
+}
+
+//Output buffer used by every print function. A buffer either drains into a FILE whenever its
+//storage fills, or writes into a fixed caller-provided array, in which case output past the
+//end is dropped but still counted.
+typedef struct lisp_buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+    size_t dropped;
+    FILE* file;
+} lisp_buffer;
+
+#define LISP_BUFFER_SIZE (16 * 1024)
+
+void lisp_buffer_init_file(lisp_buffer* buffer, FILE* file, char* storage, size_t size) {
+    buffer->data = storage;
+    buffer->length = 0;
+    buffer->capacity = size;
+    buffer->dropped = 0;
+    buffer->file = file;
+}
+
+void lisp_buffer_init_fixed(lisp_buffer* buffer, char* data, size_t size) {
+    lisp_buffer_init_file(buffer, NULL, data, size);
+}
 
-void lisp_value_expression_print(lisp_value* value, char open, char close) {
-    putchar(open);
+void lisp_buffer_flush(lisp_buffer* buffer) {
+    if(buffer->file && buffer->length) {
+        fwrite(buffer->data, 1, buffer->length, buffer->file);
+        buffer->length = 0;
+    }
+}
+
+void lisp_buffer_write(lisp_buffer* buffer, char* bytes, size_t length) {
+    if(buffer->capacity - buffer->length < length) {
+        if(buffer->file) {
+            lisp_buffer_flush(buffer);
+            if(length > buffer->capacity) {
+                fwrite(bytes, 1, length, buffer->file);
+                return;
+            }
+        } else {
+            size_t fits = buffer->capacity - buffer->length;
+            buffer->dropped += length - fits;
+            length = fits;
+        }
+    }
+    if(length == 0) {
+        return;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+void lisp_buffer_put(lisp_buffer* buffer, char c) {
+    if(buffer->length < buffer->capacity) {
+        buffer->data[buffer->length++] = c;
+        return;
+    }
+    lisp_buffer_write(buffer, &c, 1);
+}
+
+void lisp_buffer_write_string(lisp_buffer* buffer, char* string) {
+    lisp_buffer_write(buffer, string, strlen(string));
+}
+
+//Formats right to left into a scratch array. The magnitude is taken as unsigned so that
+//LONG_MIN does not overflow.
+void lisp_buffer_write_number(lisp_buffer* buffer, long x) {
+    char digits[3 * sizeof(long) + 2];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    unsigned long magnitude = x < 0 ? 0ul - (unsigned long)x : (unsigned long)x;
+    do {
+        *--start = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude);
+    if(x < 0) {
+        *--start = '-';
+    }
+    lisp_buffer_write(buffer, start, end - start);
+}
+
+//lisp_value_write forward declaration
+void lisp_value_write(lisp_buffer* buffer, lisp_value* value);
+
+void lisp_value_expression_write(lisp_buffer* buffer, lisp_value* value, char open, char close) {
+    lisp_buffer_put(buffer, open);
     for(int i = 0; i < value->count; i++) {
-        lisp_value_print(value->cell[i]);
+        lisp_value_write(buffer, value->as.cell[i]);
         if(i != (value->count - 1)) {
-            putchar(' ');
+            lisp_buffer_put(buffer, ' ');
         }
     }
-    putchar(close);
+    lisp_buffer_put(buffer, close);
 }
 
-void lisp_value_print(lisp_value* value) {
-    switch (value->type) {
+void lisp_value_write(lisp_buffer* buffer, lisp_value* value) {
+    switch (lisp_value_type(value)) {
         case VALUE_NUMBER:
-            printf("%li", value->number);
+            lisp_buffer_write_number(buffer, lisp_value_as_number(value));
             break;
         case VALUE_ERROR:
-            printf("Error: %s", value->error);
+            lisp_buffer_write_string(buffer, "Error: ");
+            lisp_buffer_write_string(buffer, value->as.error);
             break;
         case VALUE_SYMBOL:
-            printf("%s", value->symbol);
+            lisp_buffer_write_string(buffer, value->as.symbol->name);
             break;
         case VALUE_S_EXPRESSION:
-            lisp_value_expression_print(value, '(', ')');
+            lisp_value_expression_write(buffer, value, '(', ')');
             break;
         case VALUE_Q_EXPRESSION:
-            lisp_value_expression_print(value, '{', '}');
+            lisp_value_expression_write(buffer, value, '{', '}');
             break;
     }
 }
 
+//Printing goes through stdio at the end, so it stays ordered with the other output on stdout.
+void lisp_value_print(lisp_value* value) {
+    char storage[LISP_BUFFER_SIZE];
+    lisp_buffer buffer;
+    lisp_buffer_init_file(&buffer, stdout, storage, sizeof(storage));
+    lisp_value_write(&buffer, value);
+    lisp_buffer_flush(&buffer);
+}
+
 void lisp_value_print_line(lisp_value* value) {
-    lisp_value_print(value);
-    putchar('\n');
+    char storage[LISP_BUFFER_SIZE];
+    lisp_buffer buffer;
+    lisp_buffer_init_file(&buffer, stdout, storage, sizeof(storage));
+    lisp_value_write(&buffer, value);
+    lisp_buffer_put(&buffer, '\n');
+    lisp_buffer_flush(&buffer);
+}
+
+//Prints into a caller-provided array like snprintf: the output is truncated to fit and
+//NUL-terminated, and the return value is the length the full output needs.
+size_t lisp_value_print_to(lisp_value* value, char* data, size_t size) {
+    lisp_buffer buffer;
+    lisp_buffer_init_fixed(&buffer, data, size ? size - 1 : 0);
+    lisp_value_write(&buffer, value);
+    if(size) {
+        data[buffer.length] = '\0';
+    }
+    return buffer.length + buffer.dropped;
 }
 
 lisp_value* lisp_value_pop(lisp_value* value, int i) {
-    lisp_value* child = value->cell[i];
-    memmove(&value->cell[i], &value->cell[i + 1], sizeof(lisp_value*) * (value->count - i - 1));
+    lisp_value* child = value->as.cell[i];
+    memmove(&value->as.cell[i], &value->as.cell[i + 1], sizeof(lisp_value*) * (value->count - i - 1));
     value->count--;
-    value->cell = realloc(value->cell, sizeof(lisp_value*) * value->count);
     return child;
 }
 
@@ -181,9 +661,10 @@ lisp_value* lisp_value_take(lisp_value* value, int i) {
 }
 
 lisp_value* lisp_value_join(lisp_value* x, lisp_value* y) {
-    while(y->count) {
-        x = lisp_value_add(x, lisp_value_pop(y, 0));
+    for(int i = 0; i < y->count; i++) {
+        x = lisp_value_add(x, y->as.cell[i]);
     }
+    y->count = 0;
     lisp_value_delete(y);
     return x;
 }
@@ -205,22 +686,28 @@ lisp_value* builtin_list(lisp_value* value) {
 
 lisp_value* builtin_head(lisp_value* value) {
     LISP_ASSERT(value, value->count == 1, "Function 'head' was passed too many values.");
-    LISP_ASSERT(value, value->cell[0]->type == VALUE_Q_EXPRESSION, "Function 'head' was passed an incorrect type: Not Q-Expression {}.");
-    LISP_ASSERT(value, value->cell[0]->count != 0, "Function 'head' was passed an empty Q-Expression {}.");
+    LISP_ASSERT(value, lisp_value_type(value->as.cell[0]) == VALUE_Q_EXPRESSION, "Function 'head' was passed an incorrect type: Not Q-Expression {}.");
+    LISP_ASSERT(value, value->as.cell[0]->count != 0, "Function 'head' was passed an empty Q-Expression {}.");
 
     lisp_value* first_child = lisp_value_take(value, 0);
-    while(first_child->count > 1) {
-        lisp_value_delete(lisp_value_pop(first_child, 1));
+    for(int i = 1; i < first_child->count; i++) {
+        lisp_value_delete(first_child->as.cell[i]);
     }
+    first_child->count = 1;
     return first_child;
 }
 
 //TODO: Tail should take n from end. Currently takes "body".
-lisp_value* builtin_tail(lisp_value* value) {
+//Both engines print this reminder on every call, so it lives in one place.
+void lisp_tail_notice(void) {
     printf("Fix tail to be tail.");
+}
+
+lisp_value* builtin_tail(lisp_value* value) {
+    lisp_tail_notice();
     LISP_ASSERT(value, value->count == 1, "Function 'tail' was passed too many values.");
-    LISP_ASSERT(value, value->cell[0]->type == VALUE_Q_EXPRESSION, "Function 'tail' was passed an incorrect type: Not Q-Expression {}.");
-    LISP_ASSERT(value, value->cell[0]->count != 0, "Function 'tail' was passed  an empty Q-Expression {}.");
+    LISP_ASSERT(value, lisp_value_type(value->as.cell[0]) == VALUE_Q_EXPRESSION, "Function 'tail' was passed an incorrect type: Not Q-Expression {}.");
+    LISP_ASSERT(value, value->as.cell[0]->count != 0, "Function 'tail' was passed  an empty Q-Expression {}.");
 
     lisp_value* first_child = lisp_value_take(value, 0);
     lisp_value_delete(lisp_value_pop(first_child, 0));
@@ -229,82 +716,82 @@ lisp_value* builtin_tail(lisp_value* value) {
 
 lisp_value* builtin_join(lisp_value* value) {
     for(int i = 0; i < value->count; i++) {
-        LISP_ASSERT(value, value->cell[i]->type == VALUE_Q_EXPRESSION, "Function 'join' passed incorrect type: Not Q-Expression {}.");
+        LISP_ASSERT(value, lisp_value_type(value->as.cell[i]) == VALUE_Q_EXPRESSION, "Function 'join' passed incorrect type: Not Q-Expression {}.");
     }
 
-    lisp_value* first_child = lisp_value_pop(value, 0);
-    while(value->count) {
-        first_child = lisp_value_join(first_child, lisp_value_pop(value, 0));
+    lisp_value* first_child = value->as.cell[0];
+    for(int i = 1; i < value->count; i++) {
+        first_child = lisp_value_join(first_child, value->as.cell[i]);
     }
+    value->count = 0;
     lisp_value_delete(value);
     return first_child;
 }
 
 lisp_value* builtin_evaluate(lisp_value* value) {
     LISP_ASSERT(value, value->count == 1, "Function 'evaluate' was passed too many values.");
-    LISP_ASSERT(value, value->cell[0]->type == VALUE_Q_EXPRESSION, "Function 'evaluate' passed incorrect type: Not Q-Expression {}.");
+    LISP_ASSERT(value, lisp_value_type(value->as.cell[0]) == VALUE_Q_EXPRESSION, "Function 'evaluate' passed incorrect type: Not Q-Expression {}.");
     lisp_value* first_child = lisp_value_take(value, 0);
     first_child->type = VALUE_S_EXPRESSION;
     return lisp_value_evaluate(first_child);
 }
 
-lisp_value* builtin_operator(lisp_value* value, char* operator) {
+lisp_value* builtin_operator(lisp_value* value, int builtin) {
     for(int i = 0; i < value->count; i++) {
-        if(value->cell[i]->type != VALUE_NUMBER) {
+        if(lisp_value_type(value->as.cell[i]) != VALUE_NUMBER) {
             lisp_value_delete(value);
             return lisp_value_error("Cannot operate on non-numbers.");
         }
     }
 
-    lisp_value* first_element = lisp_value_pop(value, 0);
+    long result = lisp_value_as_number(value->as.cell[0]);
 
-    if((strcmp(operator, "-") == 0) && value->count == 0) {
-        first_element->number = -first_element->number;
+    if(builtin == BUILTIN_SUBTRACT && value->count == 1) {
+        result = -result;
     }
 
-    while(value->count > 0) {
-        lisp_value* next_element = lisp_value_pop(value, 0);
-        if(strcmp(operator, "+") == 0) {
-            first_element->number = first_element->number + next_element->number;
-        }
-        if(strcmp(operator, "-") == 0) {
-            first_element->number = first_element->number - next_element->number;
-        }
-        if(strcmp(operator, "*") == 0) {
-            first_element->number = first_element->number * next_element->number;
-        }
-        if(strcmp(operator, "/") == 0) {
-            if(next_element->number == 0) {
-                lisp_value_delete(first_element);
-                lisp_value_delete(next_element);
-                first_element = lisp_value_error("Division by zero.");
+    for(int i = 1; i < value->count; i++) {
+        long next = lisp_value_as_number(value->as.cell[i]);
+        switch (builtin) {
+            case BUILTIN_ADD:
+                result = result + next;
+                break;
+            case BUILTIN_SUBTRACT:
+                result = result - next;
+                break;
+            case BUILTIN_MULTIPLY:
+                result = result * next;
+                break;
+            case BUILTIN_DIVIDE:
+                if(next == 0) {
+                    lisp_value_delete(value);
+                    return lisp_value_error("Division by zero.");
+                }
+                result = result / next;
                 break;
-            }
-            first_element->number = first_element->number / next_element->number;
         }
     }
     lisp_value_delete(value);
-    return first_element;
+    return lisp_value_number(result);
 }
 
-lisp_value* builtin_type(lisp_value* value, char* function) {
-    if(strcmp("list", function) == 0) {
-        return builtin_list(value);
-    }
-    if(strcmp("head", function) == 0) {
-        return builtin_head(value);
-    }
-    if(strcmp("tail", function) == 0) {
-        return builtin_tail(value);
-    }
-    if(strcmp("join", function) == 0) {
-        return builtin_join(value);
-    }
-    if(strcmp("evaluate", function) == 0) {
-        return builtin_evaluate(value);
-    }
-    if(strstr("+-/*", function)) {
-        return builtin_operator(value, function);
+lisp_value* builtin_call(lisp_value* value, int builtin) {
+    switch (builtin) {
+        case BUILTIN_LIST:
+            return builtin_list(value);
+        case BUILTIN_HEAD:
+            return builtin_head(value);
+        case BUILTIN_TAIL:
+            return builtin_tail(value);
+        case BUILTIN_JOIN:
+            return builtin_join(value);
+        case BUILTIN_EVALUATE:
+            return builtin_evaluate(value);
+        case BUILTIN_ADD:
+        case BUILTIN_SUBTRACT:
+        case BUILTIN_MULTIPLY:
+        case BUILTIN_DIVIDE:
+            return builtin_operator(value, builtin);
     }
     lisp_value_delete(value);
     return lisp_value_error("Unknown function.");
@@ -312,11 +799,11 @@ lisp_value* builtin_type(lisp_value* value, char* function) {
 
 lisp_value* lisp_value_evaluate_s_expression(lisp_value* value) {
     for(int i = 0; i < value->count; i++) {
-        value->cell[i] = lisp_value_evaluate(value->cell[i]);
+        value->as.cell[i] = lisp_value_evaluate(value->as.cell[i]);
     }
 
     for(int i = 0; i < value->count; i++) {
-        if(value->cell[i]->type == VALUE_ERROR) {
+        if(lisp_value_type(value->as.cell[i]) == VALUE_ERROR) {
             return lisp_value_take(value, i);
         }
     }
@@ -330,26 +817,506 @@ lisp_value* lisp_value_evaluate_s_expression(lisp_value* value) {
     }
 
     lisp_value* first = lisp_value_pop(value, 0);
-    if(first->type != VALUE_SYMBOL) {
+    if(lisp_value_type(first) != VALUE_SYMBOL) {
         lisp_value_delete(first);
         lisp_value_delete(value);
         return lisp_value_error("S-expression does not start with a symbol.");
     }
 
-    lisp_value* result = builtin_type(value, first->symbol);
+    lisp_value* result = builtin_call(value, first->as.symbol->builtin);
     lisp_value_delete(first);
     return result;
 }
 
 lisp_value* lisp_value_evaluate(lisp_value* value) {
-    if(value->type == VALUE_S_EXPRESSION) {
+    if(lisp_value_type(value) == VALUE_S_EXPRESSION) {
         return lisp_value_evaluate_s_expression(value);
     }
     return value;
 }
 
+//Bytecode engine. A read S-expression is compiled into a flat chunk of instructions
+//which a stack machine then executes. Literals are pushed as borrowed pointers into
+//the read tree, so the tree is never mutated or freed while it runs.
+enum { ENGINE_BYTECODE, ENGINE_TREE_WALKER };
+
+enum { READER_MPC, READER_DIRECT };
+
+enum { OPCODE_PUSH_CONSTANT, OPCODE_PUSH_EMPTY, OPCODE_MAKE_Q_EXPRESSION, OPCODE_CALL_BUILTIN, OPCODE_CALL };
+
+typedef struct lisp_instruction {
+    unsigned char opcode;
+    unsigned char builtin;
+    int operand;
+} lisp_instruction;
+
+typedef struct lisp_chunk {
+    int count;
+    int capacity;
+    lisp_instruction* code;
+    int constant_count;
+    int constant_capacity;
+    lisp_value** constants;
+} lisp_chunk;
+
+//A stack slot either owns its value or borrows it from the read tree.
+typedef struct lisp_slot {
+    lisp_value* value;
+    int owned;
+} lisp_slot;
+
+typedef struct lisp_vm {
+    int count;
+    int capacity;
+    lisp_slot* stack;
+} lisp_vm;
+
+void lisp_chunk_init(lisp_chunk* chunk) {
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->code = NULL;
+    chunk->constant_count = 0;
+    chunk->constant_capacity = 0;
+    chunk->constants = NULL;
+}
+
+void lisp_chunk_free(lisp_chunk* chunk) {
+    free(chunk->code);
+    free(chunk->constants);
+}
+
+void lisp_chunk_emit(lisp_chunk* chunk, int opcode, int builtin, int operand) {
+    if(chunk->count == chunk->capacity) {
+        chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 16;
+        chunk->code = realloc(chunk->code, sizeof(lisp_instruction) * chunk->capacity);
+    }
+    chunk->code[chunk->count].opcode = opcode;
+    chunk->code[chunk->count].builtin = builtin;
+    chunk->code[chunk->count].operand = operand;
+    chunk->count++;
+}
+
+void lisp_chunk_emit_constant(lisp_chunk* chunk, lisp_value* value) {
+    if(chunk->constant_count == chunk->constant_capacity) {
+        chunk->constant_capacity = chunk->constant_capacity ? chunk->constant_capacity * 2 : 16;
+        chunk->constants = realloc(chunk->constants, sizeof(lisp_value*) * chunk->constant_capacity);
+    }
+    chunk->constants[chunk->constant_count] = value;
+    lisp_chunk_emit(chunk, OPCODE_PUSH_CONSTANT, 0, chunk->constant_count);
+    chunk->constant_count++;
+}
+
+//lisp_compile_s_expression forward declaration
+void lisp_compile_s_expression(lisp_chunk* chunk, lisp_value* value);
+
+void lisp_compile_expression(lisp_chunk* chunk, lisp_value* value) {
+    if(lisp_value_type(value) == VALUE_S_EXPRESSION) {
+        lisp_compile_s_expression(chunk, value);
+        return;
+    }
+    lisp_chunk_emit_constant(chunk, value);
+}
+
+//Compiles the children of value as if value were an S-expression, mirroring
+//lisp_value_evaluate_s_expression: () stays empty, (x) yields x, anything else is a call.
+void lisp_compile_s_expression(lisp_chunk* chunk, lisp_value* value) {
+    if(value->count == 0) {
+        lisp_chunk_emit(chunk, OPCODE_PUSH_EMPTY, 0, 0);
+        return;
+    }
+    if(value->count == 1) {
+        lisp_compile_expression(chunk, value->as.cell[0]);
+        return;
+    }
+
+    int builtin = lisp_value_type(value->as.cell[0]) == VALUE_SYMBOL ? value->as.cell[0]->as.symbol->builtin : BUILTIN_UNKNOWN;
+    if(builtin == BUILTIN_UNKNOWN) {
+        for(int i = 0; i < value->count; i++) {
+            lisp_compile_expression(chunk, value->as.cell[i]);
+        }
+        lisp_chunk_emit(chunk, OPCODE_CALL, 0, value->count);
+        return;
+    }
+
+    for(int i = 1; i < value->count; i++) {
+        lisp_compile_expression(chunk, value->as.cell[i]);
+    }
+    if(builtin == BUILTIN_LIST) {
+        lisp_chunk_emit(chunk, OPCODE_MAKE_Q_EXPRESSION, 0, value->count - 1);
+    } else {
+        lisp_chunk_emit(chunk, OPCODE_CALL_BUILTIN, builtin, value->count - 1);
+    }
+}
+
+void lisp_vm_init(lisp_vm* vm) {
+    vm->count = 0;
+    vm->capacity = 0;
+    vm->stack = NULL;
+}
+
+void lisp_vm_free(lisp_vm* vm) {
+    free(vm->stack);
+}
+
+void lisp_vm_push(lisp_vm* vm, lisp_slot slot) {
+    if(vm->count == vm->capacity) {
+        vm->capacity = vm->capacity ? vm->capacity * 2 : 64;
+        vm->stack = realloc(vm->stack, sizeof(lisp_slot) * vm->capacity);
+    }
+    vm->stack[vm->count++] = slot;
+}
+
+lisp_slot lisp_slot_owned(lisp_value* value) {
+    lisp_slot slot;
+    slot.value = value;
+    slot.owned = 1;
+    return slot;
+}
+
+//Hands the value of a slot over to the caller, copying it if it is borrowed.
+lisp_value* lisp_slot_take(lisp_slot* slot) {
+    if(!slot->owned) {
+        return lisp_value_copy(slot->value);
+    }
+    slot->owned = 0;
+    return slot->value;
+}
+
+void lisp_slot_release(lisp_slot* slot) {
+    if(slot->owned) {
+        lisp_value_delete(slot->value);
+    }
+}
+
+#define LISP_VM_ASSERT(condition, error) \
+    if(!(condition)) { \
+        return lisp_slot_owned(lisp_value_error(error)); \
+    }
+
+lisp_slot lisp_vm_list(lisp_slot* args, int argc) {
+    lisp_value* list = lisp_value_q_expression();
+    for(int i = 0; i < argc; i++) {
+        list = lisp_value_add(list, lisp_slot_take(&args[i]));
+    }
+    return lisp_slot_owned(list);
+}
+
+lisp_slot lisp_vm_head(lisp_slot* args, int argc) {
+    LISP_VM_ASSERT(argc == 1, "Function 'head' was passed too many values.");
+    LISP_VM_ASSERT(lisp_value_type(args[0].value) == VALUE_Q_EXPRESSION, "Function 'head' was passed an incorrect type: Not Q-Expression {}.");
+    LISP_VM_ASSERT(args[0].value->count != 0, "Function 'head' was passed an empty Q-Expression {}.");
+
+    lisp_value* first = args[0].owned ? lisp_value_pop(args[0].value, 0) : lisp_value_copy(args[0].value->as.cell[0]);
+    return lisp_slot_owned(lisp_value_add(lisp_value_q_expression(), first));
+}
+
+lisp_slot lisp_vm_tail(lisp_slot* args, int argc) {
+    lisp_tail_notice();
+    LISP_VM_ASSERT(argc == 1, "Function 'tail' was passed too many values.");
+    LISP_VM_ASSERT(lisp_value_type(args[0].value) == VALUE_Q_EXPRESSION, "Function 'tail' was passed an incorrect type: Not Q-Expression {}.");
+    LISP_VM_ASSERT(args[0].value->count != 0, "Function 'tail' was passed  an empty Q-Expression {}.");
+
+    if(args[0].owned) {
+        lisp_value* list = lisp_slot_take(&args[0]);
+        lisp_value_delete(lisp_value_pop(list, 0));
+        return lisp_slot_owned(list);
+    }
+    lisp_value* list = lisp_value_q_expression();
+    for(int i = 1; i < args[0].value->count; i++) {
+        list = lisp_value_add(list, lisp_value_copy(args[0].value->as.cell[i]));
+    }
+    return lisp_slot_owned(list);
+}
+
+lisp_slot lisp_vm_join(lisp_slot* args, int argc) {
+    for(int i = 0; i < argc; i++) {
+        LISP_VM_ASSERT(lisp_value_type(args[i].value) == VALUE_Q_EXPRESSION, "Function 'join' passed incorrect type: Not Q-Expression {}.");
+    }
+
+    lisp_value* list = lisp_slot_take(&args[0]);
+    for(int i = 1; i < argc; i++) {
+        lisp_value* next = args[i].value;
+        for(int j = 0; j < next->count; j++) {
+            list = lisp_value_add(list, args[i].owned ? next->as.cell[j] : lisp_value_copy(next->as.cell[j]));
+        }
+        if(args[i].owned) {
+            next->count = 0;
+        }
+    }
+    return lisp_slot_owned(list);
+}
+
+lisp_slot lisp_vm_operator(lisp_slot* args, int argc, int builtin) {
+    for(int i = 0; i < argc; i++) {
+        LISP_VM_ASSERT(lisp_value_type(args[i].value) == VALUE_NUMBER, "Cannot operate on non-numbers.");
+    }
+
+    long result = lisp_value_as_number(args[0].value);
+    if(builtin == BUILTIN_SUBTRACT && argc == 1) {
+        result = -result;
+    }
+    for(int i = 1; i < argc; i++) {
+        long next = lisp_value_as_number(args[i].value);
+        switch (builtin) {
+            case BUILTIN_ADD:
+                result = result + next;
+                break;
+            case BUILTIN_SUBTRACT:
+                result = result - next;
+                break;
+            case BUILTIN_MULTIPLY:
+                result = result * next;
+                break;
+            case BUILTIN_DIVIDE:
+                LISP_VM_ASSERT(next != 0, "Division by zero.");
+                result = result / next;
+                break;
+        }
+    }
+    return lisp_slot_owned(lisp_value_number(result));
+}
+
+//lisp_vm_run forward declaration
+void lisp_vm_run(lisp_vm* vm, lisp_chunk* chunk);
+
+//Runs a Q-Expression as code. The stack may grow while it runs, so args is not used afterwards.
+lisp_slot lisp_vm_evaluate_builtin(lisp_vm* vm, lisp_slot* args, int argc) {
+    LISP_VM_ASSERT(argc == 1, "Function 'evaluate' was passed too many values.");
+    LISP_VM_ASSERT(lisp_value_type(args[0].value) == VALUE_Q_EXPRESSION, "Function 'evaluate' passed incorrect type: Not Q-Expression {}.");
+
+    lisp_value* body = args[0].value;
+    int owned = args[0].owned;
+    args[0].owned = 0;
+
+    lisp_chunk chunk;
+    lisp_chunk_init(&chunk);
+    lisp_compile_s_expression(&chunk, body);
+    lisp_vm_run(vm, &chunk);
+    lisp_chunk_free(&chunk);
+
+    lisp_slot result = vm->stack[--vm->count];
+    if(owned) {
+        result = lisp_slot_owned(lisp_slot_take(&result));
+        lisp_value_delete(body);
+    }
+    return result;
+}
+
+lisp_slot lisp_vm_builtin(lisp_vm* vm, int builtin, lisp_slot* args, int argc) {
+    switch (builtin) {
+        case BUILTIN_LIST:
+            return lisp_vm_list(args, argc);
+        case BUILTIN_HEAD:
+            return lisp_vm_head(args, argc);
+        case BUILTIN_TAIL:
+            return lisp_vm_tail(args, argc);
+        case BUILTIN_JOIN:
+            return lisp_vm_join(args, argc);
+        case BUILTIN_EVALUATE:
+            return lisp_vm_evaluate_builtin(vm, args, argc);
+        case BUILTIN_ADD:
+        case BUILTIN_SUBTRACT:
+        case BUILTIN_MULTIPLY:
+        case BUILTIN_DIVIDE:
+            return lisp_vm_operator(args, argc, builtin);
+    }
+    return lisp_slot_owned(lisp_value_error("Unknown function."));
+}
+
+//Replaces the top count slots with the result of calling builtin on them, or with the
+//first error among them. BUILTIN_UNKNOWN dispatches on the symbol in the first slot.
+void lisp_vm_call(lisp_vm* vm, int builtin, int count) {
+    lisp_slot* args = vm->stack + vm->count - count;
+    lisp_slot result;
+    int error = -1;
+    for(int i = 0; i < count && error < 0; i++) {
+        if(lisp_value_type(args[i].value) == VALUE_ERROR) {
+            error = i;
+        }
+    }
+
+    if(error >= 0) {
+        result = args[error];
+        args[error].owned = 0;
+    } else if(builtin != BUILTIN_UNKNOWN) {
+        result = lisp_vm_builtin(vm, builtin, args, count);
+    } else if(lisp_value_type(args[0].value) != VALUE_SYMBOL) {
+        result = lisp_slot_owned(lisp_value_error("S-expression does not start with a symbol."));
+    } else {
+        result = lisp_vm_builtin(vm, args[0].value->as.symbol->builtin, args + 1, count - 1);
+    }
+
+    args = vm->stack + vm->count - count;
+    for(int i = 0; i < count; i++) {
+        lisp_slot_release(&args[i]);
+    }
+    vm->count -= count;
+    lisp_vm_push(vm, result);
+}
+
+void lisp_vm_run(lisp_vm* vm, lisp_chunk* chunk) {
+    lisp_slot slot;
+    for(int pc = 0; pc < chunk->count; pc++) {
+        lisp_instruction instruction = chunk->code[pc];
+        switch (instruction.opcode) {
+            case OPCODE_PUSH_CONSTANT:
+                slot.value = chunk->constants[instruction.operand];
+                slot.owned = 0;
+                lisp_vm_push(vm, slot);
+                break;
+            case OPCODE_PUSH_EMPTY:
+                lisp_vm_push(vm, lisp_slot_owned(lisp_value_s_expression()));
+                break;
+            case OPCODE_MAKE_Q_EXPRESSION:
+                lisp_vm_call(vm, BUILTIN_LIST, instruction.operand);
+                break;
+            case OPCODE_CALL_BUILTIN:
+                lisp_vm_call(vm, instruction.builtin, instruction.operand);
+                break;
+            case OPCODE_CALL:
+                lisp_vm_call(vm, BUILTIN_UNKNOWN, instruction.operand);
+                break;
+        }
+    }
+}
+
+//Evaluates a read expression without consuming it. The caller still owns value.
+lisp_value* lisp_vm_evaluate(lisp_vm* vm, lisp_value* value) {
+    lisp_chunk chunk;
+    lisp_chunk_init(&chunk);
+    lisp_compile_expression(&chunk, value);
+    lisp_vm_run(vm, &chunk);
+    lisp_chunk_free(&chunk);
+    return lisp_slot_take(&vm->stack[--vm->count]);
+}
+
+//Everything one line of input needs to be read, evaluated and printed, shared by the REPL
+//and by script mode.
+typedef struct lisp_interpreter {
+    int engine;
+    int reader;
+    int use_arena;
+    mpc_parser_t* parser;
+    mpc_parse_ctx_t* parse_context;
+    lisp_vm vm;
+    lisp_arena arena;
+} lisp_interpreter;
+
+void lisp_interpreter_run_line(lisp_interpreter* interpreter, char* filename, char* input) {
+    if(interpreter->use_arena) {
+        lisp_active_arena = &interpreter->arena;
+    }
+    lisp_value* expression = NULL;
+    if(interpreter->reader == READER_DIRECT) {
+        expression = lisp_read(input);
+    }
+    //The direct reader gives up on syntax errors, so mpc is still what reports them.
+    if(expression == NULL) {
+        mpc_result_t result;
+        if(mpc_parse_ctx_view(interpreter->parse_context, filename, input, strlen(input), interpreter->parser, &result)) {
+            expression = lisp_value_read(result.output);
+            mpc_ast_delete(result.output);
+        } else {
+            mpc_err_print(result.error);
+            mpc_err_delete(result.error);
+        }
+    }
+
+    if(expression) {
+        lisp_value* evalued_result;
+        if(interpreter->engine == ENGINE_TREE_WALKER) {
+            evalued_result = lisp_value_evaluate(expression);
+        } else {
+            evalued_result = lisp_vm_evaluate(&interpreter->vm, expression);
+            lisp_value_delete(expression);
+        }
+        //Only the result outlives the line, so it is copied out before the arena is dropped.
+        if(interpreter->use_arena) {
+            lisp_active_arena = NULL;
+            evalued_result = lisp_value_copy(evalued_result);
+        }
+        lisp_value_print_line(evalued_result);
+        lisp_value_delete(evalued_result);
+    }
+    if(interpreter->use_arena) {
+        lisp_active_arena = NULL;
+        lisp_arena_reset(&interpreter->arena);
+    }
+}
+
+//Script mode. Whatever read(2) returns, up to a large block, is appended to one growable
+//buffer and every complete line in it is evaluated exactly as if it had been typed at the
+//REPL, without a prompt or history. A line longer than the buffer grows it. Files and stdin
+//share this path: a pipe or terminal returns what is available instead of a full block, and
+//stdout is flushed before each read, so results show up once their line is complete while
+//batch input still gets one write per block.
+#define LISP_READ_BLOCK_SIZE (1 << 20)
+
+void lisp_interpreter_run_stream(lisp_interpreter* interpreter, char* filename, int fd) {
+    size_t capacity = LISP_READ_BLOCK_SIZE;
+    size_t length = 0;
+    char* buffer = malloc(capacity + 1);
+    while(1) {
+        if(length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity + 1);
+        }
+        fflush(stdout);
+        ssize_t got = read(fd, buffer + length, capacity - length);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            break;
+        }
+        length += got;
+
+        char* line = buffer;
+        char* end;
+        while((end = memchr(line, '\n', length - (line - buffer)))) {
+            *end = '\0';
+            lisp_interpreter_run_line(interpreter, filename, line);
+            line = end + 1;
+        }
+        length -= line - buffer;
+        memmove(buffer, line, length);
+    }
+    if(length > 0) {
+        buffer[length] = '\0';
+        lisp_interpreter_run_line(interpreter, filename, buffer);
+    }
+    free(buffer);
+}
+
 int main(int argc, char** argv) {
 
+    lisp_interpreter interpreter;
+    interpreter.engine = ENGINE_BYTECODE;
+    interpreter.reader = READER_MPC;
+    interpreter.use_arena = 0;
+    char* script = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--tree-walker") == 0) {
+            interpreter.engine = ENGINE_TREE_WALKER;
+        }
+        if(strcmp(argv[i], "--arena") == 0) {
+            interpreter.use_arena = 1;
+        }
+        if(strcmp(argv[i], "--direct-reader") == 0) {
+            interpreter.reader = READER_DIRECT;
+        }
+        if(strcmp(argv[i], "-") == 0) {
+            script = argv[i];
+        }
+        if(strcmp(argv[i], "-f") == 0) {
+            if(i + 1 == argc) {
+                fprintf(stderr, "Option '-f' needs a file name.\n");
+                return 1;
+            }
+            script = argv[++i];
+        }
+    }
+
     mpc_parser_t* Number = mpc_new("number");
     mpc_parser_t* Symbol = mpc_new("symbol");
     mpc_parser_t* S_Expression = mpc_new("s_expression");
@@ -369,28 +1336,44 @@ int main(int argc, char** argv) {
         ",
         Number, Symbol, S_Expression, Q_Expression, Expression, Sammallus);
 
-    puts("Sammallus Version 0.1");
-    puts("Press Ctrl+c to Exit\n");
+    interpreter.parser = Sammallus;
+    interpreter.parse_context = mpc_parse_ctx_new();
+    lisp_vm_init(&interpreter.vm);
+    lisp_arena_init(&interpreter.arena);
 
-    while(1) {
-        char* input = readline("sammallus> ");
-        add_history(input);
-
-        mpc_result_t result;
-        if(mpc_parse("<stdin>", input, Sammallus, &result)) {
-            lisp_value* evalued_result = lisp_value_evaluate(lisp_value_read(result.output));
-            lisp_value_print_line(evalued_result);
-            lisp_value_delete(evalued_result);
-            mpc_ast_delete(result.output);
+    int status = 0;
+    if(script) {
+        int from_stdin = strcmp(script, "-") == 0;
+        int fd = from_stdin ? STDIN_FILENO : open(script, O_RDONLY);
+        if(fd >= 0) {
+            static char output[1 << 16];
+            setvbuf(stdout, output, _IOFBF, sizeof(output));
+            lisp_interpreter_run_stream(&interpreter, from_stdin ? "<stdin>" : script, fd);
+            fflush(stdout);
+            if(!from_stdin) {
+                close(fd);
+            }
         } else {
-            mpc_err_print(result.error);
-            mpc_err_delete(result.error);
+            fprintf(stderr, "Could not open file '%s'.\n", script);
+            status = 1;
         }
+    } else {
+        puts("Sammallus Version 0.1");
+        puts("Press Ctrl+c to Exit\n");
 
-        free(input);
+        while(1) {
+            char* input = readline("sammallus> ");
+            add_history(input);
+            lisp_interpreter_run_line(&interpreter, "<stdin>", input);
+            free(input);
+        }
     }
 
+    lisp_vm_free(&interpreter.vm);
+    lisp_arena_free(&interpreter.arena);
+    mpc_parse_ctx_delete(interpreter.parse_context);
+    lisp_symbol_table_free(&lisp_symbols);
     mpc_cleanup(6, Number, Symbol, S_Expression, Q_Expression, Expression, Sammallus);
 
-    return 0;
+    return status;
 }